@@ -7,6 +7,8 @@ You need a .txt file with initial coordinates for your atoms. If you got this
 from me, you can use startgenerator to do this.
 startgenerator only works well with particle numbers with integer cube roots (or
 2 particles,) so this program has that constraint as well. 
+The number of particles is however many lines startingpositions.txt has; the
+temperature and box length are asked for when the program starts.
 
 -Luciano Laratelli
 luciano.e.laratelli@outlook.com
@@ -30,27 +32,18 @@ struct move_values
 };
 
 /***************
-IF COMPILING IN LINUX, THESE CONST INTS MUST BE CHANGED TO USE #define INSTEAD, i.e
-#define N 1000
-
-If you know why this is the case, please let me know!
+These used to be const ints, which C won't take as an array size at file
+scope. They're set at startup now, and particles is allocated once N is known.
 ****************/
 
 //this is the NVT part
-const int N = 1000; //number of particles
-const double T = 77; //kelvin; 
-const int L = 200; //length of one side of the cube, L = sigma
+int N; //number of particles
+double T; //kelvin; 
+double L; //length of one side of the cube, L = sigma
 const double k = 1.0;//boltzmann factor
 
-
-/*
-#define N 1000
-#define T 10
-#define L 20
-*/
-
 //we declare our structs so we can use them to do our bidding
-struct particle particles[N];
+struct particle * particles;
 struct move_values move;
 
 /*******************
@@ -61,8 +54,21 @@ each line of the file is an (x,y,z) with format x y z\n
 void starting_positions()
 {
     int p;
+    double x[3];
     FILE * startingpositions; 
     startingpositions = fopen("startingpositions.txt", "r");
+    if(startingpositions == NULL)
+    {
+        printf("Can't open startingpositions.txt!\n");
+        exit(EXIT_FAILURE);
+    }
+    N = 0;
+    while(fscanf(startingpositions,"%lf %lf %lf\n", &x[0], &x[1], &x[2]) == 3)
+    {
+        N++;//one particle per line
+    }
+    rewind(startingpositions);
+    particles = malloc(N * sizeof(struct particle));
     for(p=0;p<N;p++)
     {
         fscanf(startingpositions,"%lf %lf %lf\n", &particles[p].x[0],&particles[p].x[1],&particles[p].x[2]);
@@ -312,6 +318,10 @@ int main()
     int m; //maximum number of tries
     printf("How many tries do you want to do?\n"); //user-directed!
     scanf("%d", &m);
+    printf("What temperature (in kelvin)?\n");
+    scanf("%lf", &T);
+    printf("How long is one side of the box?\n");
+    scanf("%lf", &L);
     starting_positions(); //read in starting positions
     double cpe = PEfinder(),//current potential energy
            npe;
@@ -349,6 +359,7 @@ int main()
     average = sum / (m); //again, hopefully self explanatory
     clock_t end = clock();
     double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
+    free(particles);
     printf("Done! Hope it worked out. \nThis run took %f seconds.\nThe average energy was %f.\nHave a nice day!\n",time_spent, average); //it never does
     return 0;
 }
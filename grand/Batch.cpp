@@ -0,0 +1,264 @@
+#include "MonteCarlo.h"
+#include <sys/stat.h>
+
+/*******************************************************************************
+ * Batch runs. A whole isotherm used to be one process per state point, each
+ * redoing the setup and all of them writing the same file names. -batch reads
+ * a list of state points instead and runs them in one process on the thread
+ * pool, every job with its own directory and the results collected in one
+ * table at the end.
+ *
+ * The species, box and every other option come from the command line and are
+ * shared by all the jobs; a job sets its temperature and reservoir pressure.
+ * A job marked warm starts from the previous job's last configuration, as long
+ * as that one converged, which saves re-equilibrating from an empty box at
+ * every point of an adsorption isotherm. A run of jobs tied together like that
+ * has to go in order, so each such chain is one task for the pool, and the
+ * chains run side by side.
+ * ****************************************************************************/
+
+//how far apart the third and fourth quarter averages can be, as a fraction of
+//the larger, before a job counts as not converged
+#define CONVERGENCE_TOLERANCE 0.05
+
+/*******************************************************************************
+ * read_jobs reads the job list: one job per line, starting with the
+ * temperature in kelvin and the pressure in atm, then optionally the word
+ * warm and a directory name, in either order. Jobs without a directory get
+ * job_0, job_1 and so on. Lines starting with # are comments.
+ * ****************************************************************************/
+bool read_jobs(const char *file, std::vector<batch_job> *jobs)
+{
+        FILE * in = fopen(file, "r");
+        if(in == NULL)
+        {
+            printf("Can't open the job list %s.\n", file);
+            return false;
+        }
+        char line[512];
+        while(fgets(line, sizeof line, in) != NULL)
+        {
+            batch_job job = {};
+            int used = 0;
+            if(line[0] == '#' || sscanf(line, "%lf %lf%n", &job.temperature,
+                                        &job.pressure, &used) != 2)
+            {
+                continue;
+            }
+            if(job.temperature <= 0 || job.pressure <= 0)
+            {
+                printf("Every job in %s needs a positive temperature "
+                       "and pressure.\n", file);
+                fclose(in);
+                return false;
+            }
+            snprintf(job.directory, sizeof job.directory, "job_%d",
+                     (int)jobs->size());
+            char word[256];
+            int more = 0;
+            for(char * rest = line + used;
+                sscanf(rest, "%255s%n", word, &more) == 1;rest += more)
+            {
+                if(strcmp(word, "warm") == 0)
+                {
+                    job.warm = true;
+                }
+                else
+                {
+                    snprintf(job.directory, sizeof job.directory, "%s", word);
+                }
+            }
+            jobs->push_back(job);
+        }
+        fclose(in);
+        if(jobs->empty())
+        {
+            printf("The job list %s has no jobs in it.\n", file);
+            return false;
+        }
+        return true;
+}
+
+//fopen of name inside the job's directory
+static FILE * job_file(const batch_job *job, const char *name)
+{
+        char path[512];
+        snprintf(path, sizeof path, "%s/%s", job->directory, name);
+        return fopen(path, "w");
+}
+
+//whether two averages of the same thing are within the tolerance, or within
+//floor of each other when they are both small
+static bool close_enough(double a, double b, double floor)
+{
+        return fabs(a - b) <= CONVERGENCE_TOLERANCE * fmax(fabs(a), fabs(b)) +
+                              floor;
+}
+
+/*******************************************************************************
+ * run_job runs one job from start to finish, beginning from the particles in
+ * start. The run is done in three pieces so the third and fourth quarters can
+ * be averaged on their own: if they agree on both the number of particles (to
+ * within one particle) and the energy (to within kT), the job has converged
+ * and the next one may start where it stopped. With -restart, job number
+ * starts from its own checkpoint instead.
+ * ****************************************************************************/
+static void run_job(GCMC_System *sys, batch_job *job,
+                    const particle_store *start, int number)
+{
+        sys->system_temp = job->temperature;
+        sys->pressure = job->pressure;
+        copy_system(sys, start);
+        if(sys->restart_file != NULL)
+        {
+            restart_copy(sys, number, false);
+        }
+        mkdir(job->directory, 0755);//fine if it's already there
+        if(sys->energy_output_flag)
+        {
+            sys->energies = job_file(job, "energies.dat");
+        }
+        if(sys->output_flag)
+        {
+            sys->output = job_file(job, "output.txt");
+        }
+        sys->unweightedradial = job_file(job, "unweightedradialdistribution.txt");
+        sys->weightedradial = job_file(job, "weightedradialdistribution.txt");
+        if(sys->unweightedradial == NULL || sys->weightedradial == NULL)
+        {
+            printf("Can't write to the job directory %s.\n", job->directory);
+            exit(EXIT_FAILURE);
+        }
+        int half = sys->maxStep / 2,
+            three_quarters = 3 * sys->maxStep / 4;
+        run_simulation(sys, half);//the sums only start at production, here
+        double energy_at_half = sys->sumenergy,
+               particles_at_half = sys->sumparticles;
+        run_simulation(sys, three_quarters);
+        double energy_at_three_quarters = sys->sumenergy,
+               particles_at_three_quarters = sys->sumparticles;
+        run_simulation(sys, sys->maxStep);
+        double third = three_quarters - half,
+               fourth = sys->maxStep - three_quarters;
+        job->converged = third > 0 && fourth > 0 &&
+            close_enough((particles_at_three_quarters - particles_at_half) / third,
+                         (sys->sumparticles - particles_at_three_quarters) / fourth,
+                         1.0) &&
+            close_enough((energy_at_three_quarters - energy_at_half) / third,
+                         (sys->sumenergy - energy_at_three_quarters) / fourth,
+                         k * sys->system_temp);
+        job->average_particles = sys->sumparticles/sys->production_steps;
+        job->average_energy = sys->sumenergy/sys->production_steps;
+        if(sys->histogram.bin_width > 0)
+        {
+            FILE * histogram = job_file(job, "histogram.txt");
+            if(histogram != NULL)
+            {
+                write_histogram(sys, histogram);
+                fclose(histogram);
+            }
+        }
+        close_outputs(sys);
+        printf("  Finished %s (%.2lf K, %g atm)%s.\n", job->directory,
+               job->temperature, job->pressure,
+               job->converged ? "" : ", not converged");
+}
+
+typedef struct _batch_run
+{
+        GCMC_System * base;
+        batch_job * jobs;
+        std::vector<int> chains;//first job of every chain, then one past the end
+} batch_run;
+
+//runs one chain of jobs in order, warm starting where they ask to, and
+//checkpoints each job at its end
+static void chain_task(void *context, int task, int worker)
+{
+        batch_run * run = (batch_run*)context;
+        GCMC_System previous;
+        bool have_previous = false;
+        for(int j = run->chains[task];j<run->chains[task+1];j++)
+        {
+            batch_job * job = &run->jobs[j];
+            GCMC_System sys = *run->base;
+            rng_seed(&sys.rng, run->base->seed, 1 + j);//main's stream is 0
+            job->warm_started = job->warm && have_previous &&
+                                run->jobs[j-1].converged &&
+                                sys.restart_file == NULL;
+            run_job(&sys, job, job->warm_started ? &previous.particles
+                                                 : &run->base->particles, j);
+            checkpoint_copy(&sys, j, run->base->checkpoint_file);
+            if(have_previous)
+            {
+                free_copy(&previous);
+            }
+            previous = sys;
+            have_previous = true;
+        }
+        if(have_previous)
+        {
+            free_copy(&previous);
+        }
+}
+
+/*******************************************************************************
+ * run_batch runs every job in jobs, with base (set up by main up to its cell
+ * list) as the template and its particles as the cold start. The results go in
+ * the jobs themselves, and are printed and written to isotherm.txt at the end.
+ * ****************************************************************************/
+void run_batch(GCMC_System *base, std::vector<batch_job> *jobs)
+{
+        batch_run run;
+        run.base = base;
+        run.jobs = jobs->data();
+        int count = jobs->size();
+        for(int j = 0;j<count;j++)
+        {
+            if(j == 0 || !(*jobs)[j].warm)
+            {
+                run.chains.push_back(j);
+            }
+        }
+        run.chains.push_back(count);
+        int chains = run.chains.size() - 1;
+        if(base->pool == NULL || chains < 2)
+        {
+            for(int c = 0;c<chains;c++)
+            {
+                chain_task(&run, c, 0);
+            }
+        }
+        else
+        {
+            pool_run(base->pool, chains, chain_task, &run);
+        }
+        printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+        printf("|                      BATCH  RESULTS                      |\n");
+        printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+        FILE * summary = fopen("isotherm.txt", "w");
+        if(summary != NULL)
+        {
+            fprintf(summary, "# T(K)\tP(atm)\t<N>\t<E>(K)\tconverged\twarm"
+                             "\tdirectory\n");
+        }
+        for(const batch_job & job : *jobs)
+        {
+            printf("%-12s %8.2lf K %10g atm  <N> = %lf  <E> = %lf K%s%s\n",
+                   job.directory, job.temperature, job.pressure,
+                   job.average_particles, job.average_energy,
+                   job.warm_started ? "  (warm)" : "",
+                   job.converged ? "" : "  (not converged)");
+            if(summary != NULL)
+            {
+                fprintf(summary, "%lf\t%g\t%lf\t%lf\t%d\t%d\t%s\n",
+                        job.temperature, job.pressure, job.average_particles,
+                        job.average_energy, job.converged, job.warm_started,
+                        job.directory);
+            }
+        }
+        if(summary != NULL)
+        {
+            fclose(summary);
+        }
+}
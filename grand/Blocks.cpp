@@ -0,0 +1,312 @@
+#include "MonteCarlo.h"
+
+/*******************************************************************************
+ * Block averages. Production used to start halfway through every run and the
+ * run always went the whole way, which wastes half of a run that settles
+ * quickly and biases one that doesn't. Every step's energy and N now go into
+ * blocks of block_steps steps, and the block means give the averages, their
+ * error bars and the statistical inefficiency of each.
+ *
+ * With -converge, production starts once the blocks say the run has settled
+ * and the run stops as soon as both error bars are under the targets. Settling
+ * is found the way Chodera (J. Chem. Theory Comput. 12, 1799) does it: out of
+ * a set of candidate starts spread over the blocks so far, the one that leaves
+ * the most uncorrelated blocks behind it. The run counts as settled once that
+ * start is in the first half of the blocks, and the blocks after it don't
+ * drift: the means of their first and second halves have to agree to within
+ * their error bars, for the energy and N both. A run still climbing keeps
+ * pushing its best start late and its halves apart, so it doesn't settle.
+ * ****************************************************************************/
+
+//fewest production blocks behind an error bar or a settling decision
+#define MIN_BLOCKS 20
+//blocks between looking for equilibration or convergence
+#define CHECK_BLOCKS 10
+//how many starts equilibration detection tries, spread over the blocks
+#define EQUILIBRATION_CANDIDATES 20
+//how many combined error bars apart the halves after the start can be
+#define DRIFT_ERRORS 2.0
+
+//mean, error bar and statistical inefficiency of one quantity over blocks
+//first to end-1
+typedef struct _block_result
+{
+        double mean,
+               error,
+               inefficiency,//in steps
+               correlation;//integrated correlation time, in blocks
+        int blocks;
+} block_result;
+
+/*******************************************************************************
+ * analyze_blocks works out the mean of blocks first to end-1 and its error bar
+ * from the variance of the block means times their integrated correlation
+ * time, summed over the initial positive stretch of the autocorrelation. The
+ * statistical inefficiency, in steps, compares that to the variance of the
+ * single steps, which comes from the blocks' means of squares.
+ * ****************************************************************************/
+static block_result analyze_blocks(const std::vector<double> &means,
+                                   const std::vector<double> &squares,
+                                   int first, int end, int block_steps)
+{
+        block_result result = {0, 0, 1, 1, end - first};
+        int n = result.blocks;
+        if(n < 2)
+        {
+            if(n == 1)
+            {
+                result.mean = means[first];
+            }
+            return result;
+        }
+        double mean_square = 0;
+        for(int b = first;b<end;b++)
+        {
+            result.mean += means[b];
+            mean_square += squares[b];
+        }
+        result.mean /= n;
+        mean_square /= n;
+        double variance = 0;
+        for(int b = first;b<end;b++)
+        {
+            variance += (means[b] - result.mean) * (means[b] - result.mean);
+        }
+        variance /= n - 1;
+        if(variance <= 0)
+        {
+            return result;
+        }
+        for(int lag = 1;lag<n/2;lag++)
+        {
+            double covariance = 0;
+            for(int b = first;b+lag<end;b++)
+            {
+                covariance += (means[b] - result.mean) *
+                              (means[b+lag] - result.mean);
+            }
+            double rho = covariance / ((n - lag) * variance);
+            if(rho <= 0)
+            {
+                break;
+            }
+            result.correlation += 2 * rho * (1 - (double)lag / n);
+        }
+        result.error = sqrt(variance * result.correlation / n);
+        double step_variance = mean_square - result.mean * result.mean;
+        if(step_variance > 0)
+        {
+            result.inefficiency = fmax(1.0, block_steps * variance *
+                                            result.correlation / step_variance);
+        }
+        return result;
+}
+
+//the candidate start that leaves the most uncorrelated blocks of one
+//quantity, out of starts spread over all but the last MIN_BLOCKS blocks
+static int best_start(const std::vector<double> &means,
+                      const std::vector<double> &squares, int block_steps)
+{
+        int n = means.size(),
+            best = 0;
+        double most = 0;
+        for(int c = 0;c<EQUILIBRATION_CANDIDATES;c++)
+        {
+            int start = (n - MIN_BLOCKS) * c / EQUILIBRATION_CANDIDATES;
+            block_result r = analyze_blocks(means, squares, start, n,
+                                            block_steps);
+            double uncorrelated = r.blocks / r.correlation;
+            if(uncorrelated > most)
+            {
+                most = uncorrelated;
+                best = start;
+            }
+        }
+        return best;
+}
+
+//whether the two halves of the blocks from start on agree to within their
+//error bars, so one quantity isn't still drifting
+static bool steady(const std::vector<double> &means,
+                   const std::vector<double> &squares, int start,
+                   int block_steps)
+{
+        int n = means.size(),
+            middle = (start + n) / 2;
+        block_result early = analyze_blocks(means, squares, start, middle,
+                                            block_steps),
+                     late = analyze_blocks(means, squares, middle, n,
+                                           block_steps);
+        return fabs(early.mean - late.mean) <=
+               DRIFT_ERRORS * sqrt(early.error * early.error +
+                                      late.error * late.error);
+}
+
+//starts the production phase at the current step, dropping the open block
+//so no block straddles the start
+void start_production(GCMC_System *sys)
+{
+        block_stats * blocks = &sys->blocks;
+        sys->production_start = sys->step;
+        freeze_tuning(sys);//moves have to stay put from here on
+        blocks->first_production = blocks->energy.size();
+        blocks->filled = 0;
+        blocks->energy_sum = blocks->energy_squares = 0;
+        blocks->particle_sum = blocks->particle_squares = 0;
+}
+
+//called once a CHECK_BLOCKS-th block is done in a -converge run
+static void check_convergence(GCMC_System *sys)
+{
+        block_stats * blocks = &sys->blocks;
+        int n = blocks->energy.size();
+        if(sys->step < sys->production_start)
+        {
+            if(n < MIN_BLOCKS)
+            {
+                return;
+            }
+            int start = std::max(best_start(blocks->energy,
+                                            blocks->energy_squared,
+                                            blocks->block_steps),
+                                 best_start(blocks->particles,
+                                            blocks->particles_squared,
+                                            blocks->block_steps));
+            if(start <= n / 2 &&
+               steady(blocks->energy, blocks->energy_squared, start,
+                      blocks->block_steps) &&
+               steady(blocks->particles, blocks->particles_squared, start,
+                      blocks->block_steps))
+            {
+                blocks->settled_at = blocks->ends[start] -
+                                     blocks->block_steps + 1;
+                start_production(sys);
+                if(!sys->quiet_flag)
+                {
+                    printf("  Equilibrated by step %d; production starts "
+                           "at step %d.\n", blocks->settled_at, sys->step);
+                }
+            }
+            return;
+        }
+        if(n - blocks->first_production < MIN_BLOCKS)
+        {
+            return;
+        }
+        block_result energy = analyze_blocks(blocks->energy,
+                                             blocks->energy_squared,
+                                             blocks->first_production, n,
+                                             blocks->block_steps),
+                     particles = analyze_blocks(blocks->particles,
+                                                blocks->particles_squared,
+                                                blocks->first_production, n,
+                                                blocks->block_steps);
+        if(energy.error <= blocks->energy_target &&
+           particles.error <= blocks->particle_target)
+        {
+            sys->stopped = true;
+        }
+}
+
+/*******************************************************************************
+ * block_add puts the current step into the open block, closing it once it is
+ * block_steps long. Blocks before production are only kept in a -converge run,
+ * where they are what equilibration is detected from.
+ * ****************************************************************************/
+void block_add(GCMC_System *sys)
+{
+        block_stats * blocks = &sys->blocks;
+        double energy = sys->current_pe,
+               particles = sys->particles.count;
+        blocks->energy_sum += energy;
+        blocks->energy_squares += energy * energy;
+        blocks->particle_sum += particles;
+        blocks->particle_squares += particles * particles;
+        if(++blocks->filled < blocks->block_steps)
+        {
+            return;
+        }
+        double steps = blocks->filled;
+        if(sys->converge_flag || sys->step >= sys->production_start)
+        {
+            blocks->ends.push_back(sys->step);
+            blocks->energy.push_back(blocks->energy_sum / steps);
+            blocks->energy_squared.push_back(blocks->energy_squares / steps);
+            blocks->particles.push_back(blocks->particle_sum / steps);
+            blocks->particles_squared.push_back(blocks->particle_squares /
+                                                steps);
+        }
+        blocks->filled = 0;
+        blocks->energy_sum = blocks->energy_squares = 0;
+        blocks->particle_sum = blocks->particle_squares = 0;
+        if(sys->converge_flag && blocks->energy.size() % CHECK_BLOCKS == 0)
+        {
+            check_convergence(sys);
+        }
+}
+
+//the summary lines, each starting with prefix
+static void print_summary(FILE *out, const char *prefix, GCMC_System *sys,
+                          const block_result *energy,
+                          const block_result *particles)
+{
+        fprintf(out, "%sProduction: steps %d to %d, %d blocks of %d steps%s\n",
+                prefix, sys->production_start, sys->step - 1, energy->blocks,
+                sys->blocks.block_steps,
+                sys->stopped ? " (error bars reached)" : "");
+        fprintf(out, "%sEnergy: %lf +/- %lf K, statistical inefficiency "
+                     "%.1lf steps\n", prefix, energy->mean, energy->error,
+                energy->inefficiency);
+        fprintf(out, "%sParticles: %lf +/- %lf, statistical inefficiency "
+                     "%.1lf steps\n", prefix, particles->mean, particles->error,
+                particles->inefficiency);
+}
+
+/*******************************************************************************
+ * write_block_summary prints the production averages with their error bars
+ * and statistical inefficiencies, and writes every block's means to out (if it
+ * isn't NULL) under the same summary. A -converge run that never settled has
+ * no production phase, so it only says so and writes the blocks.
+ * ****************************************************************************/
+void write_block_summary(GCMC_System *sys, FILE *out)
+{
+        block_stats * blocks = &sys->blocks;
+        int n = blocks->energy.size();
+        bool settled = !sys->converge_flag || blocks->settled_at >= 0;
+        if(settled)
+        {
+            block_result energy = analyze_blocks(blocks->energy,
+                                                 blocks->energy_squared,
+                                                 blocks->first_production, n,
+                                                 blocks->block_steps),
+                         particles = analyze_blocks(blocks->particles,
+                                                    blocks->particles_squared,
+                                                    blocks->first_production,
+                                                    n, blocks->block_steps);
+            print_summary(stdout, "", sys, &energy, &particles);
+            if(out != NULL)
+            {
+                print_summary(out, "# ", sys, &energy, &particles);
+            }
+        }
+        else
+        {
+            printf("The run never equilibrated in its %d steps, so it has no "
+                   "production averages or g(r).\n", sys->step);
+            if(out != NULL)
+            {
+                fprintf(out, "# Never equilibrated in %d steps\n", sys->step);
+            }
+        }
+        if(out == NULL)
+        {
+            return;
+        }
+        fprintf(out, "# block\tlast step\t<E>(K)\t<N>\tproduction\n");
+        for(int b = 0;b<(int)blocks->energy.size();b++)
+        {
+            fprintf(out, "%d\t%d\t%lf\t%lf\t%d\n", b, blocks->ends[b],
+                    blocks->energy[b], blocks->particles[b],
+                    settled && b >= blocks->first_production);
+        }
+}
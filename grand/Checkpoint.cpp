@@ -0,0 +1,222 @@
+#include "MonteCarlo.h"
+
+/*******************************************************************************
+ * Checkpoints. -checkpoint name writes the configuration and the state of the
+ * run's random stream to name at every progress report and at the end, and
+ * -restart name starts a run from one. Coordinates are written as the store's
+ * fixed point integers and everything else in hex floating point, so reading a
+ * checkpoint back gives exactly the particles, ids and random numbers it was
+ * written from, and two runs restarted from the same checkpoint with the same
+ * options do exactly the same thing.
+ *
+ * Replicas, batch jobs and Gibbs boxes are quiet copies of main's system, so
+ * their drivers checkpoint them instead: copy m goes to name.m with its own
+ * random stream, and -restart name gives copy m the particles in name.m.
+ * ****************************************************************************/
+
+#define CHECKPOINT_HEADER "grand checkpoint 1"
+
+//writes sys's configuration and random stream to file, through a temporary
+//file so a run killed halfway through writing leaves the old one whole
+bool write_checkpoint(GCMC_System *sys, const char *file)
+{
+        char temporary[512];
+        snprintf(temporary, sizeof temporary, "%s.tmp", file);
+        FILE * out = fopen(temporary, "w");
+        if(out == NULL)
+        {
+            printf("Can't write the checkpoint %s.\n", file);
+            return false;
+        }
+        const split_rng * rng = &sys->rng;
+        fprintf(out, "%s\n%s %d\nside %a\n", CHECKPOINT_HEADER,
+                sys->particle_type, sys->step, sys->box_side_length);
+        fprintf(out, "rng %llu %llu %llu %d\n", (unsigned long long)rng->key,
+                (unsigned long long)rng->stream,
+                (unsigned long long)rng->block, rng->next);
+        for(int r = 0;r<RNG_BATCH;r++)
+        {
+            fprintf(out, "%a%c", rng->batch[r], r+1 < RNG_BATCH ? ' ' : '\n');
+        }
+        const particle_store * store = &sys->particles;
+        //the free ids in stack order, so they're handed out again in that order
+        fprintf(out, "ids %d %d\n", store->next_id, store->free_count);
+        for(int f = 0;f<store->free_count;f++)
+        {
+            fprintf(out, "%d%c", store->free_ids[f],
+                    f+1 < store->free_count ? ' ' : '\n');
+        }
+        fprintf(out, "particles %d\n", store->count);
+        for(int s = 0;s<store->count;s++)
+        {
+            fprintf(out, "%d %u %u %u %a %a %a\n", store->id[s],
+                    store->pos[0][s],
+                    store->pos[1][s], store->pos[2][s],
+                    (double)store->dipole[0][s], (double)store->dipole[1][s],
+                    (double)store->dipole[2][s]);
+        }
+        if(fclose(out) != 0 || rename(temporary, file) != 0)
+        {
+            printf("Can't write the checkpoint %s.\n", file);
+            return false;
+        }
+        return true;
+}
+
+/*******************************************************************************
+ * read_checkpoint replaces sys's particles and random stream with the ones in
+ * file. sys has to be set up by main up to an empty store; the cell list is
+ * left for the caller to build. The checkpoint's box has to be the same size
+ * as the command line's, except with -NPT, where the box (and the cutoff with
+ * it) is scaled to the checkpoint's, and with any_side, where only the box is.
+ * ****************************************************************************/
+bool read_checkpoint(GCMC_System *sys, const char *file, bool any_side)
+{
+        FILE * in = fopen(file, "r");
+        if(in == NULL)
+        {
+            printf("Can't open the checkpoint %s.\n", file);
+            return false;
+        }
+        char header[64], type[25];
+        int step, count, next, next_id, free_count;
+        double side;
+        unsigned long long key, stream, block;
+        bool ok = fgets(header, sizeof header, in) != NULL &&
+                  strncmp(header, CHECKPOINT_HEADER,
+                          strlen(CHECKPOINT_HEADER)) == 0 &&
+                  fscanf(in, "%24s %d side %la rng %llu %llu %llu %d", type,
+                         &step, &side, &key, &stream, &block, &next) == 7 &&
+                  next >= 0 && next <= RNG_BATCH;
+        for(int r = 0;ok && r<RNG_BATCH;r++)
+        {
+            ok = fscanf(in, "%la", &sys->rng.batch[r]) == 1;
+        }
+        ok = ok && fscanf(in, " ids %d %d", &next_id, &free_count) == 2 &&
+             free_count >= 0 && free_count <= next_id;
+        std::vector<int> free_ids(ok ? free_count : 0);
+        for(int f = 0;ok && f<free_count;f++)
+        {
+            ok = fscanf(in, "%d", &free_ids[f]) == 1 && free_ids[f] >= 0 &&
+                 free_ids[f] < next_id;
+        }
+        ok = ok && fscanf(in, " particles %d", &count) == 1 && count >= 0 &&
+             count <= next_id;
+        if(!ok)
+        {
+            printf("%s isn't a checkpoint.\n", file);
+            fclose(in);
+            return false;
+        }
+        if(strcmp(type, sys->particle_type) != 0)
+        {
+            printf("The checkpoint %s is of %s, not %s.\n", file, type,
+                   sys->particle_type);
+            fclose(in);
+            return false;
+        }
+        if(side != sys->box_side_length)
+        {
+            if(sys->NPT_flag)
+            {
+                scale_box(sys, side, sys->cutoff * side / sys->box_side_length);
+            }
+            else if(any_side)
+            {
+                resize_box(sys, side);
+            }
+            else
+            {
+                printf("The checkpoint %s has a box %.4lf A wide; only -NPT "
+                       "and -gibbs can start from a different size.\n", file,
+                       side);
+                fclose(in);
+                return false;
+            }
+        }
+        sys->seed = key;
+        sys->rng.key = key;
+        sys->rng.stream = stream;
+        sys->rng.block = block;
+        sys->rng.next = next;
+        particle_store * store = &sys->particles;
+        store_reserve(store, next_id);//every id needs a slot entry
+        store->next_id = next_id;
+        store->free_count = free_count;
+        std::copy(free_ids.begin(), free_ids.end(), store->free_ids);
+        for(int s = 0;s<count;s++)
+        {
+            int id;
+            unsigned int pos[3];
+            double dipole[3];
+            if(fscanf(in, "%d %u %u %u %la %la %la", &id, &pos[0], &pos[1],
+                      &pos[2], &dipole[0], &dipole[1], &dipole[2]) != 7 ||
+               id < 0 || id >= next_id)
+            {
+                printf("The checkpoint %s ends after %d of its %d particles.\n",
+                       file, s, count);
+                fclose(in);
+                return false;
+            }
+            particle p;
+            p.id = id;
+            for(int i = 0;i<3;i++)
+            {
+                p.x[i] = 0;
+                p.dipole[i] = dipole[i];
+            }
+            int slot = store_insert(store, &p);
+            for(int i = 0;i<3;i++)
+            {
+                store->pos[i][slot] = pos[i];
+            }
+        }
+        fclose(in);
+        printf("Restarting from step %d of the run that wrote %s, seed %"
+               PRIu64 ".\n", step, file, sys->seed);
+        return true;
+}
+
+//the checkpoint of copy m of a run checkpointed to name
+static void copy_file(char *path, size_t size, const char *name, int m)
+{
+        snprintf(path, size, "%s.%d", name, m);
+}
+
+//writes copy m to its checkpoint, if the run is checkpointed to a name
+void checkpoint_copy(GCMC_System *copy, int m, const char *name)
+{
+        if(name != NULL)
+        {
+            char path[512];
+            copy_file(path, sizeof path, name, m);
+            write_checkpoint(copy, path);
+        }
+}
+
+void checkpoint_copies(GCMC_System *copies, int count, const char *name)
+{
+        for(int m = 0;m<count;m++)
+        {
+            checkpoint_copy(&copies[m], m, name);
+        }
+}
+
+/*******************************************************************************
+ * restart_copy replaces the particles and random stream of copy m, made by
+ * copy_system, with the ones in its checkpoint of copy->restart_file, and
+ * rebuilds its cell list. any_side lets the checkpoint's box be a different
+ * size, for Gibbs boxes. A copy that can't be restarted ends the run.
+ * ****************************************************************************/
+void restart_copy(GCMC_System *copy, int m, bool any_side)
+{
+        char path[512];
+        copy_file(path, sizeof path, copy->restart_file, m);
+        store_free(&copy->particles);
+        store_init(&copy->particles, copy->box_side_length);
+        if(!read_checkpoint(copy, path, any_side))
+        {
+            exit(EXIT_FAILURE);
+        }
+        build_cells(copy);
+}
@@ -0,0 +1,176 @@
+#include "MonteCarlo.h"
+
+/*******************************************************************************
+ * Gibbs ensemble. Finding vapour-liquid coexistence by scanning mu with grand
+ * takes many runs and gets ambiguous near the critical point. Here two boxes
+ * at the same temperature trade particles and volume until each holds one of
+ * the coexisting phases, which gives both densities from one run.
+ *
+ * Each box is a GCMC_System of its own running NVT translations, and between
+ * synchronization points the two run on separate threads. At every
+ * synchronization point the main thread tries a batch of particle transfers
+ * and one volume exchange (gibbs_transfer and gibbs_volume in MonteCarlo.cpp).
+ * ****************************************************************************/
+
+//largest change in ln V of the first box in one volume exchange
+#define GIBBS_VOLUME_STEP 0.05
+
+//g/cm^3 per amu/A^3
+#define GRAMS_PER_CC 1.66053907
+
+typedef struct _gibbs_round
+{
+        GCMC_System * boxes;
+        int until;
+} gibbs_round;
+
+static void box_task(void *context, int task, int worker)
+{
+        gibbs_round * round = (gibbs_round*)context;
+        run_simulation(&round->boxes[task], round->until);
+}
+
+/*******************************************************************************
+ * run_gibbs splits particles between two boxes the size of main's, each filled
+ * with a lattice of its own rather than main's particles, and synchronizes
+ * them every sync_interval steps. Each synchronization tries
+ * sync_interval / 10 transfers, in random directions, and one volume
+ * exchange. The boxes write numbered energies, output and g(r) files. The
+ * densities of the thinner and the denser box are averaged over the second
+ * half of the run, since the boxes are free to swap roles.
+ * ****************************************************************************/
+void run_gibbs(GCMC_System *base, int particles, int sync_interval)
+{
+        GCMC_System boxes[2] = {*base, *base};
+        particle_store empty;//so main's particles don't pile onto the lattices
+        store_init(&empty, base->box_side_length);
+        for(int b = 0;b<2;b++)
+        {
+            GCMC_System * box = &boxes[b];
+            box->NVT_flag = true;//the boxes only exchange through Gibbs moves
+            copy_system(box, &empty);
+            rng_seed(&box->rng, base->seed, 1 + b);//main's stream is 0
+            if(box->restart_file != NULL)
+            {
+                restart_copy(box, b, true);//with the size it had then
+            }
+            else
+            {
+                place_lattice(box, particles / 2 + (b == 0 ? particles % 2 : 0));
+                build_cells(box);
+            }
+            if(box->energy_output_flag)
+            {
+                box->energies = numbered_file("energies", ".dat", b);
+            }
+            if(box->output_flag)
+            {
+                box->output = numbered_file("output", ".txt", b);
+            }
+            box->unweightedradial = numbered_file("unweightedradialdistribution",
+                                                  ".txt", b);
+            box->weightedradial = numbered_file("weightedradialdistribution",
+                                                ".txt", b);
+        }
+        store_free(&empty);
+        if(sync_interval < 1)
+        {
+            sync_interval = 1;
+        }
+        int transfers = sync_interval / 10 > 0 ? sync_interval / 10 : 1,
+            transfer_attempts = 0,
+            transfers_accepted = 0,
+            volume_attempts = 0,
+            volumes_accepted = 0,
+            samples = 0,
+            tenth = base->maxStep / 10 > 0 ? base->maxStep / 10 : 1;
+        double low_density = 0,
+               high_density = 0;
+        gibbs_round round = {boxes, 0};
+        while(round.until < base->maxStep)
+        {
+            int previous = round.until;
+            round.until = std::min(round.until + sync_interval, base->maxStep);
+            if(base->pool == NULL)
+            {
+                box_task(&round, 0, 0);
+                box_task(&round, 1, 0);
+            }
+            else
+            {
+                pool_run(base->pool, 2, box_task, &round);
+            }
+            if(round.until / tenth != previous / tenth)
+            {
+                double cycles_till_now = (double)(clock()-base->start_time),
+                       time_till_now = cycles_till_now/CLOCKS_PER_SEC;
+                printf("  %.0f%% of iteration steps done. Time elapsed:"\
+                        " %.2lf seconds.\n",\
+                        ((double)round.until/(double)base->maxStep)*100,
+                        time_till_now);
+                checkpoint_copies(boxes, 2, base->checkpoint_file);
+            }
+            if(round.until == base->maxStep)
+            {
+                break;
+            }
+            for(int t = 0;t<transfers;t++)
+            {
+                int from = random_index(&boxes[0], 2);
+                transfer_attempts++;
+                if(gibbs_transfer(&boxes[from], &boxes[1 - from]))
+                {
+                    transfers_accepted++;
+                }
+            }
+            volume_attempts++;
+            if(gibbs_volume(&boxes[0], &boxes[1], GIBBS_VOLUME_STEP))
+            {
+                volumes_accepted++;
+            }
+            if(round.until >= base->maxStep * .5)
+            {
+                double density_0 = boxes[0].particles.count / boxes[0].volume,
+                       density_1 = boxes[1].particles.count / boxes[1].volume;
+                low_density += fmin(density_0, density_1);
+                high_density += fmax(density_0, density_1);
+                samples++;
+            }
+        }
+        checkpoint_copies(boxes, 2, base->checkpoint_file);
+        printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+        printf("|                      GIBBS  RESULTS                      |\n");
+        printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+        for(int b = 0;b<2;b++)
+        {
+            GCMC_System * box = &boxes[b];
+            printf("Box %d (final side %.2lf A):\n"
+                   "\tAverage number of particles: %lf\n"
+                   "\tAverage energy: %lf K\n", b, box->box_side_length,
+                   box->sumparticles/box->production_steps,
+                   box->sumenergy/box->production_steps);
+        }
+        if(samples > 0)
+        {
+            low_density /= samples;
+            high_density /= samples;
+            printf("Coexisting densities: %lf and %lf per A^3\n"
+                   "                      (%lf and %lf g/cm^3)\n",
+                   low_density, high_density,
+                   low_density * base->particle_mass * GRAMS_PER_CC,
+                   high_density * base->particle_mass * GRAMS_PER_CC);
+        }
+        printf("Transfers accepted: %d of %d (%.1lf%%)\n"
+               "Volume exchanges accepted: %d of %d (%.1lf%%)\n",
+               transfers_accepted, transfer_attempts,
+               transfer_attempts > 0 ? 100.0 * transfers_accepted /
+                                       transfer_attempts : 0.0,
+               volumes_accepted, volume_attempts,
+               volume_attempts > 0 ? 100.0 * volumes_accepted /
+                                     volume_attempts : 0.0);
+        for(int b = 0;b<2;b++)
+        {
+            close_outputs(&boxes[b]);
+            free_copy(&boxes[b]);
+        }
+}
@@ -0,0 +1,319 @@
+#include "MonteCarlo.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+/*******************************************************************************
+ * Lennard-Jones kernels for one particle at p against n others stored in the
+ * contiguous arrays x, y and z. Coordinates are fixed point fractions of the
+ * box, so the minimum image is nothing more than a wrapping integer subtract
+ * read back as signed; no rounding and no branches. Everything is done in r^2,
+ * so there is no sqrt anywhere, and pairs at or past the cutoff are masked out
+ * instead of skipped.
+ *
+ * Pair terms are computed in real, so a SINGLE_PRECISION build fits twice as
+ * many pairs in a register. Each kernel adds its lanes up into a double, and
+ * everything above the kernels accumulates in double too.
+ *
+ * Every kernel computes exactly what lj_kernel_scalar does; the only
+ * difference is the order the terms are added in.
+ * ****************************************************************************/
+double lj_kernel_scalar(const fixed_coord *x, const fixed_coord *y,
+                        const fixed_coord *z, int n, const fixed_coord p[3],
+                        const lj_params *lj)
+{
+        const real scale = lj->scale,
+                   cutoff_squared = lj->cutoff_squared,
+                   sigma_sixth = lj->sigma_sixth,
+                   four_epsilon = lj->four_epsilon,
+                   shift = lj->shift;
+        double pe = 0.00;
+        for(int j = 0;j<n;j++)
+        {
+            real dx = (real)(int32_t)(p[0] - x[j]) * scale,
+                 dy = (real)(int32_t)(p[1] - y[j]) * scale,
+                 dz = (real)(int32_t)(p[2] - z[j]) * scale,
+                 r2 = dx*dx + dy*dy + dz*dz;
+            if(r2 < cutoff_squared)
+            {
+                real sr6 = sigma_sixth / (r2 * r2 * r2);
+                pe += four_epsilon * (sr6 * sr6 - sr6) - shift;
+            }
+        }
+        return pe;
+}
+
+/*******************************************************************************
+ * lj_moments_scalar adds the Lennard-Jones moments of a particle at p with n
+ * others to sum. Only NPT needs them, to rescale energies after volume moves,
+ * and only for the moves that were accepted, so it stays scalar.
+ * ****************************************************************************/
+void lj_moments_scalar(const fixed_coord *x, const fixed_coord *y,
+                       const fixed_coord *z, int n, const fixed_coord p[3],
+                       const lj_params *lj, lj_moments *sum)
+{
+        const real scale = lj->scale,
+                   cutoff_squared = lj->cutoff_squared,
+                   sigma_sixth = lj->sigma_sixth;
+        double twelfth = 0.00,
+               sixth = 0.00;
+        int pairs = 0;
+        for(int j = 0;j<n;j++)
+        {
+            real dx = (real)(int32_t)(p[0] - x[j]) * scale,
+                 dy = (real)(int32_t)(p[1] - y[j]) * scale,
+                 dz = (real)(int32_t)(p[2] - z[j]) * scale,
+                 r2 = dx*dx + dy*dy + dz*dz;
+            if(r2 < cutoff_squared)
+            {
+                real sr6 = sigma_sixth / (r2 * r2 * r2);
+                twelfth += sr6 * sr6;
+                sixth += sr6;
+                pairs++;
+            }
+        }
+        sum->twelfth += twelfth;
+        sum->sixth += sixth;
+        sum->pairs += pairs;
+}
+
+#ifdef X86_KERNELS
+
+/*******************************************************************************
+ * The same kernel source serves both precisions: VEC picks the _pd or _ps
+ * version of an intrinsic and the M types are the matching registers. The
+ * DIFF macros load one register's worth of coordinates, subtract them from the
+ * particle's as 32 bit ints and convert the signed result to real; in double
+ * that's only half a register of ints.
+ * ****************************************************************************/
+#ifdef SINGLE_PRECISION
+#define VEC(op) op##_ps
+#define M128 __m128
+#define M256 __m256
+#define M512 __m512
+#define MASK512 __mmask16
+#define SSE2_DIFF(p, c) _mm_cvtepi32_ps(_mm_sub_epi32(_mm_set1_epi32(p), \
+                            _mm_loadu_si128((const __m128i*)(c))))
+#define AVX2_DIFF(p, c) _mm256_cvtepi32_ps(_mm256_sub_epi32( \
+                            _mm256_set1_epi32(p), \
+                            _mm256_loadu_si256((const __m256i*)(c))))
+#define AVX512_DIFF(p, c, live) _mm512_maskz_cvtepi32_ps(live, \
+                            _mm512_sub_epi32(_mm512_set1_epi32(p), \
+                            _mm512_maskz_loadu_epi32(live, c)))
+#define CMP512_MASK _mm512_mask_cmp_ps_mask
+#else
+#define VEC(op) op##_pd
+#define M128 __m128d
+#define M256 __m256d
+#define M512 __m512d
+#define MASK512 __mmask8
+#define SSE2_DIFF(p, c) _mm_cvtepi32_pd(_mm_sub_epi32(_mm_set1_epi32(p), \
+                            _mm_loadl_epi64((const __m128i*)(c))))
+#define AVX2_DIFF(p, c) _mm256_cvtepi32_pd(_mm_sub_epi32(_mm_set1_epi32(p), \
+                            _mm_loadu_si128((const __m128i*)(c))))
+#define AVX512_DIFF(p, c, live) _mm512_maskz_cvtepi32_pd(live, \
+                            _mm512_maskz_extracti64x4_epi64(0xF, \
+                            _mm512_sub_epi32(_mm512_set1_epi32(p), \
+                            _mm512_maskz_loadu_epi32(live, c)), 0))
+#define CMP512_MASK _mm512_mask_cmp_pd_mask
+#endif
+#define LANES(type) ((int)(sizeof(type) / sizeof(real)))
+
+//adds up the lanes of a register that has been stored to memory
+static double sum_lanes(const real *lanes, int count)
+{
+        double sum = 0.00;
+        for(int l = 0;l<count;l++)
+        {
+            sum += lanes[l];
+        }
+        return sum;
+}
+
+__attribute__((target("sse2")))
+static double lj_kernel_sse2(const fixed_coord *x, const fixed_coord *y,
+                             const fixed_coord *z, int n,
+                             const fixed_coord p[3], const lj_params *lj)
+{
+        const int lanes = LANES(M128);
+        M128 scale = VEC(_mm_set1)(lj->scale),
+             cutoff_squared = VEC(_mm_set1)(lj->cutoff_squared),
+             sigma_sixth = VEC(_mm_set1)(lj->sigma_sixth),
+             four_epsilon = VEC(_mm_set1)(lj->four_epsilon),
+             shift = VEC(_mm_set1)(lj->shift),
+             one = VEC(_mm_set1)(1.0),
+             sum = VEC(_mm_setzero)();
+        int j = 0;
+        for(;j+lanes<=n;j+=lanes)
+        {
+            M128 dx = VEC(_mm_mul)(SSE2_DIFF(p[0], x + j), scale),
+                 dy = VEC(_mm_mul)(SSE2_DIFF(p[1], y + j), scale),
+                 dz = VEC(_mm_mul)(SSE2_DIFF(p[2], z + j), scale),
+                 r2 = VEC(_mm_add)(VEC(_mm_add)(VEC(_mm_mul)(dx, dx),
+                                                VEC(_mm_mul)(dy, dy)),
+                                   VEC(_mm_mul)(dz, dz)),
+                 inverse_r2 = VEC(_mm_div)(one, r2),
+                 sr6 = VEC(_mm_mul)(sigma_sixth, VEC(_mm_mul)(inverse_r2,
+                           VEC(_mm_mul)(inverse_r2, inverse_r2))),
+                 pe = VEC(_mm_sub)(VEC(_mm_mul)(four_epsilon,
+                          VEC(_mm_sub)(VEC(_mm_mul)(sr6, sr6), sr6)), shift);
+            sum = VEC(_mm_add)(sum, VEC(_mm_and)(VEC(_mm_cmplt)(r2,
+                                                 cutoff_squared), pe));
+        }
+        real partial[LANES(M128)];
+        VEC(_mm_storeu)(partial, sum);
+        return sum_lanes(partial, lanes) +
+               lj_kernel_scalar(x + j, y + j, z + j, n - j, p, lj);
+}
+
+__attribute__((target("avx2,fma")))
+static double lj_kernel_avx2(const fixed_coord *x, const fixed_coord *y,
+                             const fixed_coord *z, int n,
+                             const fixed_coord p[3], const lj_params *lj)
+{
+        const int lanes = LANES(M256);
+        M256 scale = VEC(_mm256_set1)(lj->scale),
+             cutoff_squared = VEC(_mm256_set1)(lj->cutoff_squared),
+             sigma_sixth = VEC(_mm256_set1)(lj->sigma_sixth),
+             four_epsilon = VEC(_mm256_set1)(lj->four_epsilon),
+             shift = VEC(_mm256_set1)(lj->shift),
+             one = VEC(_mm256_set1)(1.0),
+             sum = VEC(_mm256_setzero)();
+        int j = 0;
+        for(;j+lanes<=n;j+=lanes)
+        {
+            M256 dx = VEC(_mm256_mul)(AVX2_DIFF(p[0], x + j), scale),
+                 dy = VEC(_mm256_mul)(AVX2_DIFF(p[1], y + j), scale),
+                 dz = VEC(_mm256_mul)(AVX2_DIFF(p[2], z + j), scale),
+                 r2 = VEC(_mm256_fmadd)(dz, dz, VEC(_mm256_fmadd)(dy, dy,
+                          VEC(_mm256_mul)(dx, dx))),
+                 inverse_r2 = VEC(_mm256_div)(one, r2),
+                 sr6 = VEC(_mm256_mul)(sigma_sixth, VEC(_mm256_mul)(inverse_r2,
+                           VEC(_mm256_mul)(inverse_r2, inverse_r2))),
+                 pe = VEC(_mm256_fmsub)(four_epsilon,
+                          VEC(_mm256_fmsub)(sr6, sr6, sr6), shift);
+            sum = VEC(_mm256_add)(sum, VEC(_mm256_and)(VEC(_mm256_cmp)(r2,
+                                       cutoff_squared, _CMP_LT_OQ), pe));
+        }
+        real partial[LANES(M256)];
+        VEC(_mm256_storeu)(partial, sum);
+        return sum_lanes(partial, lanes) +
+               lj_kernel_scalar(x + j, y + j, z + j, n - j, p, lj);
+}
+
+//AVX-512 handles the leftover particles with a masked load instead of a
+//scalar loop
+__attribute__((target("avx512f")))
+static double lj_kernel_avx512(const fixed_coord *x, const fixed_coord *y,
+                               const fixed_coord *z, int n,
+                               const fixed_coord p[3], const lj_params *lj)
+{
+        const int lanes = LANES(M512);
+        M512 scale = VEC(_mm512_set1)(lj->scale),
+             cutoff_squared = VEC(_mm512_set1)(lj->cutoff_squared),
+             sigma_sixth = VEC(_mm512_set1)(lj->sigma_sixth),
+             four_epsilon = VEC(_mm512_set1)(lj->four_epsilon),
+             shift = VEC(_mm512_set1)(lj->shift),
+             one = VEC(_mm512_set1)(1.0),
+             sum = VEC(_mm512_setzero)();
+        for(int j = 0;j<n;j+=lanes)
+        {
+            MASK512 live = n - j >= lanes ? (MASK512)~0u
+                                          : (MASK512)((1u << (n - j)) - 1);
+            M512 dx = VEC(_mm512_mul)(AVX512_DIFF(p[0], x + j, live), scale),
+                 dy = VEC(_mm512_mul)(AVX512_DIFF(p[1], y + j, live), scale),
+                 dz = VEC(_mm512_mul)(AVX512_DIFF(p[2], z + j, live), scale),
+                 r2 = VEC(_mm512_fmadd)(dz, dz, VEC(_mm512_fmadd)(dy, dy,
+                          VEC(_mm512_mul)(dx, dx))),
+                 inverse_r2 = VEC(_mm512_div)(one, r2),
+                 sr6 = VEC(_mm512_mul)(sigma_sixth, VEC(_mm512_mul)(inverse_r2,
+                           VEC(_mm512_mul)(inverse_r2, inverse_r2))),
+                 pe = VEC(_mm512_fmsub)(four_epsilon,
+                          VEC(_mm512_fmsub)(sr6, sr6, sr6), shift);
+            MASK512 inside = CMP512_MASK(live, r2, cutoff_squared, _CMP_LT_OQ);
+            sum = VEC(_mm512_mask_add)(sum, inside, sum, pe);
+        }
+        real partial[LANES(M512)];
+        VEC(_mm512_storeu)(partial, sum);
+        return sum_lanes(partial, lanes);
+}
+
+#endif
+
+/*******************************************************************************
+ * select_kernel picks the widest kernel this CPU can run, once at startup.
+ * requested can name a specific one ("scalar", "sse2", "avx2" or "avx512")
+ * for benchmarking; asking for one the CPU can't do falls back to the best.
+ * ****************************************************************************/
+void select_kernel(GCMC_System *sys, const char *requested)
+{
+        sys->kernel = lj_kernel_scalar;
+        sys->kernel_isa = "scalar";
+        if(requested != NULL && strcmp(requested, "scalar") == 0)
+        {
+            return;
+        }
+#ifdef X86_KERNELS
+        __builtin_cpu_init();
+        bool any = (requested == NULL);
+        if(__builtin_cpu_supports("sse2") &&
+           (any || strcmp(requested, "sse2") == 0))
+        {
+            sys->kernel = lj_kernel_sse2;
+            sys->kernel_isa = "sse2";
+        }
+        if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+           (any || strcmp(requested, "avx2") == 0))
+        {
+            sys->kernel = lj_kernel_avx2;
+            sys->kernel_isa = "avx2";
+        }
+        if(__builtin_cpu_supports("avx512f") &&
+           (any || strcmp(requested, "avx512") == 0))
+        {
+            sys->kernel = lj_kernel_avx512;
+            sys->kernel_isa = "avx512";
+        }
+        if(!any && strcmp(requested, sys->kernel_isa) != 0)
+        {
+            printf("This CPU can't run the %s kernel.\n", requested);
+            select_kernel(sys, NULL);
+        }
+#endif
+        return;
+}
+
+/*******************************************************************************
+ * check_kernel runs the selected kernel and the scalar one over the same random
+ * particles and makes sure they agree to round-off.
+ * ****************************************************************************/
+//anywhere in the box
+static fixed_coord random_fixed(split_rng *rng)
+{
+        return (fixed_coord)(int64_t)(rng_uniform(rng) * FIXED_PER_BOX);
+}
+
+bool check_kernel(GCMC_System *sys)
+{
+        const int n = 1001;//odd, so every kernel has leftovers to deal with
+        std::vector<fixed_coord> x(n), y(n), z(n);
+        split_rng rng;//the same particles every time, away from the run's own
+        rng_seed(&rng, 0, 0);
+        for(int j = 0;j<n;j++)
+        {
+            x[j] = random_fixed(&rng);
+            y[j] = random_fixed(&rng);
+            z[j] = random_fixed(&rng);
+        }
+        fixed_coord p[3] = {random_fixed(&rng),
+                            random_fixed(&rng),
+                            random_fixed(&rng)};
+        double reference = lj_kernel_scalar(x.data(), y.data(), z.data(), n, p,
+                                            &sys->lj),
+               vector = sys->kernel(x.data(), y.data(), z.data(), n, p,
+                                    &sys->lj);
+        return fabs(vector - reference) <=
+               KERNEL_TOLERANCE * fmax(1.0, fabs(reference));
+}
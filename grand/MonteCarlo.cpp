@@ -1,5 +1,18 @@
 #include "MonteCarlo.h"
 
+//particles per task when work is split over threads. These are fixed, not
+//worked out from the thread count, so sums come out the same however many
+//threads there are
+#define ENERGY_CHUNK 64//calculate_PE and radialDistribution
+#define MOVE_CHUNK 4096//one particle's energy without a cell list
+//pairs summed between looks at whether a move can still be accepted; a whole
+//number of registers for every kernel
+#define EARLY_CHUNK 32
+//share of NPT steps that are volume moves; the rest are translations
+#define VOLUME_MOVE_FRACTION 0.1
+//steps between refreshing the -tmmc bias from the collection matrix
+#define TMMC_UPDATE_INTERVAL 10000
+
 /*******************************************************************************
  * input reads in the particle type and stores its corresponding mass (AMU),
  * LJ epsilon (K), and LJ sigma(angstroms) in the system struct
@@ -72,516 +85,2622 @@ void input(GCMC_System *sys)
    return;
 }     
 
-double calculate_PE(GCMC_System *sys)
+void store_init(particle_store *store, double box_side_length)
 {
-        if(sys->ideal_flag)
+        store->count = 0;
+        store->capacity = 0;
+        store->box_side_length = box_side_length;
+        for(int i = 0;i<3;i++)
         {
-            return 0;
+            store->pos[i] = NULL;
+            store->dipole[i] = NULL;
         }
-        int pool = sys->particles.size();
-	double dist,
-	       pe = 0.00,
-               inverse_distance,//inverse distance
-	       s_over_d_6,//powers of sigma over dist
-               s_over_d_12;
-	for (int a = 0; a < pool - 1; a++)
-	{
-            for (int b = a + 1; b < pool; b++)
-            {
-                dist = distfinder(sys, a, b);//in one dimension
-                inverse_distance = 1.0 / dist;
-                double dist_squared = inverse_distance*inverse_distance,
-                       dist_sixth = dist_squared*dist_squared*dist_squared,
-                       dist_twelfth = dist_sixth*dist_squared;
-                s_over_d_12 = sys->sigma_twelfth * dist_twelfth; 
-                s_over_d_6 = sys->sigma_sixth * dist_sixth; 
-                pe += 4.0 * sys->epsilon * (s_over_d_12 - s_over_d_6);
-                
-            }
-	}
-        if(sys->stockmayer_flag)
+        store->id = NULL;
+        store->slot = NULL;
+        store->free_ids = NULL;
+        store->free_count = 0;
+        store->next_id = 0;
+}
+
+void store_free(particle_store *store)
+{
+        for(int i = 0;i<3;i++)
         {
-            double ** matrix = matrix_madness(sys);
-            double correction = 0;
-            for(int i = 0;i<pool;i++)
-            {
-                for(int j=i+1;j<pool;j++)
-                {
-                    if(i==j)
-                    {
-                        continue;
-                    }
-                    for(int p = 0;p<3;p++)
-                    {
-                        for(int q = 0;q<3;q++)
-                        {
-                            correction += sys->particles[i].dipole[p]*
-                                          matrix[(3*i)+p][(3*j)+q]*
-                                          sys->particles[j].dipole[q];
-                        }
-                    }
-                }
-            }
-            printf("dipole dipole = %lf\njust lj = %lf\n",correction,pe);
-            pe += correction; 
-            free(matrix);
+            free(store->pos[i]);
+            free(store->dipole[i]);
         }
-	return pe;//in KELVIN
+        free(store->id);
+        free(store->slot);
+        free(store->free_ids);
+        store_init(store, store->box_side_length);
 }
 
-double distfinder(GCMC_System *sys, int id_a, int id_b)
+//angstroms to a fraction of the box; anything outside the box wraps back in
+fixed_coord to_fixed(const particle_store *store, double x)
 {
-	double dist = 0.0,
-               delta = 0.0,
-               delta2 = 0.00;
-
-	for(int i = 0; i<3; i++)
-	{
-		delta = sys->particles[id_a].x[i] - sys->particles[id_b].x[i];
-                //the following conditionals are the minimum image convention
-		if (delta >= sys->cutoff)
-		{
-			delta -= sys->box_side_length;
-		}
-		else if (delta <= (-1*sys->cutoff))
-		{
-			delta += sys->box_side_length;
-		}
-                //distance requires sum of squares of distance in each
-                //coordinate direction
-		delta2 += delta * delta;
-	}
-	dist = sqrt(delta2);
-	return dist;
+        return (fixed_coord)(int64_t)llrint(x / store->box_side_length *
+                                            FIXED_PER_BOX);
 }
 
-//return a random double between min and max (thanks StackOverflow!)
-double random_range(double min, double max)
+double to_angstroms(const particle_store *store, fixed_coord x)
 {
-	return min + (random() / ((double)RAND_MAX) * (max - min));
+        return x * (store->box_side_length / FIXED_PER_BOX);
 }
 
-MoveType make_move(GCMC_System *sys)
+//aligned replacement for an array, keeping the first count elements
+static void * grow_array(void * old, int count, int capacity, size_t size)
 {
-        //MoveType is an enum in MonteCarlo.h 
-	MoveType move;
-	int pool = sys->particles.size();
-        if(sys->NVT_flag)
+        void * grown;
+        if(posix_memalign(&grown, STORE_ALIGNMENT, capacity * size) != 0)
         {
-            double pick = random() % pool;
-            move_particle(sys,pick);
-            move = TRANSLATE;
+            printf("Out of memory for %d particles!\n", capacity);
+            exit(EXIT_FAILURE);
         }
-        else
+        memset(grown, 0, capacity * size);
+        if(old != NULL)
         {
-            if (pool == 0)
-            {
-                    create_particle(sys);
-                    pool = sys->particles.size();
-                    move = CREATE_PARTICLE;
-            }
-            else
-            {
-                double pick = random() % pool,//picks random particle
-                       choice = random_range(0,1);//random float between 0 and 1
-                fflush(stdout);
-                if (choice<0.33333)
-                {
-                        create_particle(sys);
-                        move = CREATE_PARTICLE;
-                }
-                else if (choice >= (.666667))
-                {
-                        move_particle(sys,pick);
-                        move = TRANSLATE;
-                }
-                else
-                {
-                        destroy_particle(sys, pick);
-                        move = DESTROY_PARTICLE;
-                }
-            }
+            memcpy(grown, old, count * size);
+            free(old);
         }
-	return move;
+        return grown;
 }
 
-
-double ** matrix_madness(GCMC_System *sys)
+//grows every array to hold at least capacity particles, keeping the contents
+void store_reserve(particle_store *store, int capacity)
 {
-    int n = sys->particles.size();
-    double ** matrix =(double**) malloc(sizeof(double*)*3*n);
-    for(int i = 0;i<3*n;i++)
-    {
-        matrix[i] = (double*)calloc(3*n, sizeof(double));
-    }
-    for(int a = 0;a < 3 * n;a++)
-    {
-        if(sys->polarizability == 0)
+        if(capacity <= store->capacity)
         {
-            matrix[a][a]= 1000000000000000000000000000000.f;
+            return;
         }
-        else
+        capacity = (capacity + STORE_PADDING - 1) / STORE_PADDING * STORE_PADDING;
+        for(int i = 0;i<3;i++)
         {
-            matrix[a][a] = 1/sys->polarizability;
+            store->pos[i] = (fixed_coord*)grow_array(store->pos[i],
+                                                     store->count, capacity,
+                                                     sizeof(fixed_coord));
+            store->dipole[i] = (real*)grow_array(store->dipole[i],
+                                                 store->count, capacity,
+                                                 sizeof(real));
         }
-    }
-    for(int i = 0;i<n-1;i++)
-    {
-        for(int j = i+1;j<n;j++)
-        {
-            double r = distfinder(sys,i,j),
-                   rinv = 1/r,
-                   rinv2 = rinv * rinv,
-                   rinv3 = rinv2 * rinv,
-                   rinv5 = rinv2 * rinv3,
-                   del_x = sys->particles[i].x[0] - sys->particles[j].x[0],
-                   del_y = sys->particles[i].x[1] - sys->particles[j].x[1],
-                   del_z = sys->particles[i].x[2] - sys->particles[j].x[2];
-                   if(del_x > sys->cutoff)
-                   {
-                       del_x -= sys->cutoff;
-                   }
-                   if(del_y > sys->cutoff)
-                   {
-                       del_y -= sys->cutoff;
-                   }
-                   if(del_z > sys->cutoff)
-                   {
-                       del_z -= sys->cutoff;
-                   }
-            double deltas[3] = {del_x, del_y, del_z};
-            for(int p = 0; p<3;p++)
-            {
-                for(int q = 0;q<3;q++)
-                {
-                    matrix[(3*i)+p][(3*j)+q] = -3*rinv5*deltas[p]*deltas[q];
-                    if(p==q)
-                    {
-                        matrix[(3*i)+p][(3*j)+q] += rinv3;
-                    }
-                    matrix[(3*j)+p][(3*i)+q] = matrix[(3*i)+p][(3*j)+q];
-                }
-            }
-        }
-    }
-    return matrix;
-    free(matrix);
+        //there are never more ids handed out than slots, so these fit too
+        store->id = (int*)grow_array(store->id, store->count, capacity,
+                                     sizeof(int));
+        store->slot = (int*)grow_array(store->slot, store->next_id, capacity,
+                                       sizeof(int));
+        store->free_ids = (int*)grow_array(store->free_ids, store->free_count,
+                                           capacity, sizeof(int));
+        store->capacity = capacity;
 }
 
-
-
-//this function picks a random point on the surface of a unit sphere
-double * pick_dipole_direction(GCMC_System *sys)
+static void store_write(particle_store *store, int slot, const particle *p)
 {
-    double theta = random_range(0,2*M_PI),
-           z = random_range(-1,1),
-           x = sqrt(1-(z*z)) * cos(theta),
-           y = sqrt(1-(z*z)) * cos(theta);
-    double * dipole;
-    dipole = (double*)malloc(sizeof(double) * 3);
-    dipole[0] = x * sys->dipole_magnitude;
-    dipole[1] = y * sys->dipole_magnitude;
-    dipole[2] = z * sys->dipole_magnitude;
-    return dipole;
+        for(int i = 0;i<3;i++)
+        {
+            store->pos[i][slot] = to_fixed(store, p->x[i]);
+            store->dipole[i][slot] = p->dipole[i];
+        }
+        store->id[slot] = p->id;
+        store->slot[p->id] = slot;
 }
 
-
-//insert particle at random location
-void create_particle( GCMC_System *sys)
+//an id being given back by undo is always the last one freed
+static void take_id(particle_store *store, int id)
 {
-    //we make a struct of type "particle"
-    particle to_be_inserted; 
-    //we create random coordinates for the particle 
-    to_be_inserted.x[0] = random_range(0,sys->box_side_length);
-    to_be_inserted.x[1] = random_range(0,sys->box_side_length);
-    to_be_inserted.x[2] = random_range(0,sys->box_side_length);
+        for(int f = store->free_count - 1;f>=0;f--)
+        {
+            if(store->free_ids[f] == id)
+            {
+                store->free_ids[f] = store->free_ids[--store->free_count];
+                return;
+            }
+        }
+}
 
-    if(sys->stockmayer_flag)
-    {
-        double * dipole = pick_dipole_direction(sys);
-        to_be_inserted.dipole[0] = dipole[0];
-        to_be_inserted.dipole[1] = dipole[1];
-        to_be_inserted.dipole[2] = dipole[2];
-        free(dipole);
-    }
-    //we add the particle to the vector that holds all our particles
-    sys->particles.push_back(to_be_inserted);
-    return;
+static int store_append(particle_store *store, const particle *p)
+{
+        if(store->count == store->capacity)
+        {
+            store_reserve(store, 2 * store->capacity + STORE_PADDING);
+        }
+        int slot = store->count++;
+        store_write(store, slot, p);
+        return slot;
 }
 
+//appends a particle and returns its slot
+int store_insert(particle_store *store, const particle *p)
+{
+        particle added = *p;
+        //grow before handing out an id, since a new id has to fit in slot
+        if(store->count == store->capacity)
+        {
+            store_reserve(store, 2 * store->capacity + STORE_PADDING);
+        }
+        if(added.id < 0)
+        {
+            added.id = store->free_count > 0 ? store->free_ids[--store->free_count]
+                                             : store->next_id++;
+        }
+        else
+        {
+            take_id(store, added.id);
+        }
+        return store_append(store, &added);
+}
 
-//Displace a random particle a random distance
-void move_particle(GCMC_System *sys, int pick)
+/*******************************************************************************
+ * store_remove takes out the particle in slot by moving the last particle into
+ * its place, so it's O(1) no matter where the particle is. It returns the slot
+ * the moved particle came from, which is slot itself if nothing moved.
+ * ****************************************************************************/
+int store_remove(particle_store *store, int slot)
 {
-        double negative_half_box = -0.5 * sys->box_side_length;
-        double phi = random_range(negative_half_box,sys->cutoff),
-               gamma = random_range(negative_half_box,sys->cutoff), 
-               delta = random_range(negative_half_box,sys->cutoff);
-        //store displacement in case it needs to be undone
-        sys->move.pick = pick;
-        sys->move.phi = phi;
-        sys->move.gamma = gamma;
-        sys->move.delta = delta;
-        //make the moves 
-        sys->particles[pick].x[0] += phi;
-        sys->particles[pick].x[1] += gamma;
-        sys->particles[pick].x[2] += delta;
-        //check that the particle hasn't moved out of the box 
-        for(int I=0;I<3;I++)
+        int last = --store->count;
+        store->free_ids[store->free_count++] = store->id[slot];
+        if(slot != last)
         {
-            if(sys->particles[pick].x[I] > sys->box_side_length)
+            for(int i = 0;i<3;i++)
             {
-                sys->particles[pick].x[I] -= sys->box_side_length;
-            }
-            else if(sys->particles[pick].x[I] < 0)
-            {
-                sys->particles[pick].x[I] += sys->box_side_length;
+                store->pos[i][slot] = store->pos[i][last];
+                store->dipole[i][slot] = store->dipole[i][last];
             }
+            store->id[slot] = store->id[last];
+            store->slot[store->id[slot]] = slot;
         }
-        if(sys->stockmayer_flag)
-        {
-            sys->move.dipole[0] = sys->particles[pick].dipole[0];
-            sys->move.dipole[1] = sys->particles[pick].dipole[1];
-            sys->move.dipole[2] = sys->particles[pick].dipole[2];
+        return last;
+}
 
-            double * dipole = pick_dipole_direction(sys);
-            sys->particles[pick].dipole[0] = dipole[0];
-            sys->particles[pick].dipole[1] = dipole[1];
-            sys->particles[pick].dipole[2] = dipole[2];
-            free(dipole);
+//exact inverse of store_remove: the particle goes back into slot, and whoever
+//was moved there goes back to the end
+void store_restore(particle_store *store, int slot, const particle *p)
+{
+        if(slot == store->count)
+        {
+            store_insert(store, p);
+            return;
         }
-	return;
+        particle moved;
+        store_get(store, slot, &moved);
+        store_append(store, &moved);
+        take_id(store, p->id);
+        store_write(store, slot, p);
 }
 
-//particle deletion
-void destroy_particle(GCMC_System *sys, int pick)
+//copies array into scratch and gathers it back in the new order
+template<class T>
+static void permute_array(T *array, const int *order, int count, void *scratch)
 {
-	sys->destroy.phi = sys->particles[pick].x[0];
-	sys->destroy.gamma = sys->particles[pick].x[1];
-	sys->destroy.delta = sys->particles[pick].x[2];
-        //"begin" (below) points to the address of the zeroth item 
-	// we move forward "pick" addresses 
-	// to get to the address of the item we want
-	sys->particles.erase(sys->particles.begin()+pick);
-        return;
+        T * old = (T*)scratch;
+        memcpy(old, array, count * sizeof(T));
+        for(int s = 0;s<count;s++)
+        {
+            array[s] = old[order[s]];
+        }
 }
 
-
-bool move_accepted(double cpe, double npe, MoveType move_type,\
-                   GCMC_System *sys)
+/*******************************************************************************
+ * store_permute rearranges the slots so that new slot s holds whatever was in
+ * slot order[s]. Ids follow their particles, so anything that remembers a
+ * particle by id doesn't notice; slot numbers are only good until the next
+ * permute. scratch has to hold count doubles.
+ * ****************************************************************************/
+void store_permute(particle_store *store, const int *order, void *scratch)
 {
-        double delta = npe - cpe,
-               e = M_E,
-               beta = 1.0 / (k * sys->system_temp),//thermodynamic beta
-               volume = sys->volume,
-               boltzmann_factor = pow(e,(-beta*delta)),
-               acceptance,
-               random = random_range(0,1);
-	int pool = sys->particles.size(),
-            poolplus = pool + 1;
-	if (move_type == TRANSLATE )
-	{
-                acceptance = boltzmann_factor;
-		if (acceptance > random)
-		{
-			return true;
-		}
-		else
-		{
-			return false;
-		}
-	}
-	else if (move_type == CREATE_PARTICLE)
-	{
-                acceptance =  boltzmann_factor* volume * conv_factor / \
-                             (sys->system_temp * (double)pool);
-		if (acceptance > random)
-		{
-			return true;
-		}
-		else
-		{
-			return false;
-		}
-	}
-	else if (move_type == DESTROY_PARTICLE )//if we DESTROYED a particle
-	{
-                acceptance =  boltzmann_factor * sys->system_temp * \
-                             (double)poolplus / (volume * conv_factor);
-		if (acceptance > random)
-		{
-			return true;
-		}
-		else
-		{
-			return false;
-		}
-	}
-	return true;
+        for(int i = 0;i<3;i++)
+        {
+            permute_array(store->pos[i], order, store->count, scratch);
+            permute_array(store->dipole[i], order, store->count, scratch);
+        }
+        permute_array(store->id, order, store->count, scratch);
+        for(int s = 0;s<store->count;s++)
+        {
+            store->slot[store->id[s]] = s;
+        }
 }
 
-//undoes rejected moves based on move types
-void undo_move(GCMC_System *sys, MoveType move)
+void arena_init(scratch_arena *arena)
 {
-	if (move == CREATE_PARTICLE)
-	{
-	        undo_insertion(sys);	
-	}
-	else if (move == TRANSLATE)
-	{
-		unmove_particle(sys);
-	}
-	else
-	{
-		particle added;
-		added.x[0] = sys->destroy.phi;
-		added.x[1] = sys->destroy.gamma;
-		added.x[2] = sys->destroy.delta;
-		sys->particles.push_back(added);
-	}
-	return;
+        arena->block = NULL;
+        arena->used = 0;
+        arena->size = 0;
+        arena->high_water = 0;
+        arena->retired.clear();
 }
 
-void undo_insertion(GCMC_System *sys)
+//bytes of uninitialised scratch, aligned like the store, good until the next
+//arena_reset
+void * arena_alloc(scratch_arena *arena, size_t bytes)
 {
-    sys->particles.pop_back();
+        bytes = (bytes + STORE_ALIGNMENT - 1) / STORE_ALIGNMENT * STORE_ALIGNMENT;
+        if(arena->used + bytes > arena->size)
+        {
+            //earlier buffers are still in use, so start a new block
+            if(arena->block != NULL)
+            {
+                arena->retired.push_back(arena->block);
+            }
+            arena->high_water += arena->used;
+            arena->size = 2 * (arena->high_water + bytes);
+            arena->block = (char*)grow_array(NULL, 0, arena->size, 1);
+            arena->used = 0;
+        }
+        void * buffer = arena->block + arena->used;
+        arena->used += bytes;
+        return buffer;
 }
 
-
-//undoes a rejected displacement
-void unmove_particle(GCMC_System *sys)
+void arena_reset(scratch_arena *arena)
 {
-	int pick = sys->move.pick;
-	double phi = sys->move.phi,
-		gamma = sys->move.gamma,
-		delta = sys->move.delta;
-	sys->particles[pick].x[0] -= phi;
-	sys->particles[pick].x[1] -= gamma;
-	sys->particles[pick].x[2] -= delta;
-        //check the particle is in the box
-        for(int I=0;I<3;I++)
+        if(!arena->retired.empty())
         {
-            if(sys->particles[pick].x[I] > sys->box_side_length)
+            //one block big enough for the whole of the last step from now on
+            for(char * old : arena->retired)
             {
-                sys->particles[pick].x[I] -= sys->box_side_length;
+                free(old);
             }
-            else if(sys->particles[pick].x[I] < 0)
+            arena->retired.clear();
+            size_t needed = arena->high_water + arena->used;
+            if(needed > arena->size)
             {
-                sys->particles[pick].x[I] += sys->box_side_length;
+                free(arena->block);
+                arena->size = needed;
+                arena->block = (char*)grow_array(NULL, 0, arena->size, 1);
             }
         }
-        if(sys->stockmayer_flag)
+        arena->used = 0;
+        arena->high_water = 0;
+}
+
+void arena_free(scratch_arena *arena)
+{
+        for(char * old : arena->retired)
         {
-            sys->particles[pick].dipole[0] = sys->move.dipole[0];
-            sys->particles[pick].dipole[1] = sys->move.dipole[1];
-            sys->particles[pick].dipole[2] = sys->move.dipole[2];
+            free(old);
         }
-	return;
+        free(arena->block);
+        arena_init(arena);
 }
 
-double sphere_volume(GCMC_System *sys,double diameter)
+void store_get(const particle_store *store, int slot, particle *p)
 {
-        diameter = diameter*sys->BinSize;//weighting
-	double radius = diameter;//this is important!
-        return (4.0 / 3.0) * M_PI * radius * radius * radius;
+        for(int i = 0;i<3;i++)
+        {
+            p->x[i] = to_angstroms(store, store->pos[i][slot]);
+            p->dipole[i] = store->dipole[i][slot];
+        }
+        p->id = store->id[slot];
 }
 
+//particles begin to end against every particle stored after them
+static double later_pairs(GCMC_System *sys, int begin, int end,
+                          const void *context, pair_lists *lists)
+{
+        double pe = 0.00;
+        for(int a = begin;a<end;a++)
+        {
+            pe += lj_particle_energy(sys, a, true, HUGE_VAL, lists);
+        }
+        return pe;
+}
 
-void radialDistribution(GCMC_System *sys,int step)
+template<class Potential>
+double calculate_PE(GCMC_System *sys)
 {
-	const int nBins = sys->nBins; //total number of bins
-	int IK,
-            n = sys->particles.size(),
-            num_pairs = 0;
-	double  BinSize = sys->BinSize,
-		expected_number_of_particles,
-		diameter_of_current_sphere,
-	        diameter_of_previous_sphere,
-		shell_volume,
-		dist;
-	for (int I = 0; I<n - 1; I++)
-	{
-		for (int K = I + 1; K<n; K++)
-		{
-                    dist = distfinder(sys, I, K);
-                    if(dist>sys->cutoff)
+        if(!Potential::interacts)
+        {
+            return 0;
+        }
+        int pool = sys->particles.count;
+        //every pair once, split over the threads in fixed chunks
+	double pe = parallel_sum(sys, pool, ENERGY_CHUNK, later_pairs, NULL);
+        pe += tail_energy(sys, pool);
+        if(Potential::dipoles)
+        {
+            //each pair inside the cutoff once, with the same pair term the
+            //moves use; the sum is over pairs only, so there's no self term
+            double correction = 0;
+            pair_lists * lists = &sys->lists[0];
+            for(int i = 0;i<pool;i++)
+            {
+                gather_neighbors(sys, i, lists);
+                for(int j : lists->neighbors)
+                {
+                    if(j > i)
                     {
-                        continue;
+                        correction += dipole_energy(sys, i, j);
                     }
-                    IK = int(dist / BinSize);
-                    num_pairs+=1;
-                    sys->boxes[IK] += 2;
-		}
-	}
-	diameter_of_previous_sphere = 0;
-        
-        if(step==sys->maxStep-1)
-        {
-            double real_density_hours = (sys->sumparticles/(sys->maxStep*.5))/sys->volume;
-            for (int I = 1; I <= nBins; I++)
-            {
-                    sys->boxes[I-1] /=  (sys->maxStep*.5);
-                    sys->boxes[I-1] /= sys->sumparticles/(sys->maxStep*.5);
-                    fprintf(sys->unweightedradial, "%lf\t%lf\n",BinSize*(I-1),\
-                            sys->boxes[I - 1]);
-                    diameter_of_current_sphere = I;
-                    shell_volume = sphere_volume(sys,diameter_of_current_sphere)
-                               - sphere_volume(sys,diameter_of_previous_sphere);
-                    expected_number_of_particles = shell_volume * real_density_hours;
-                    sys->boxes[I - 1] /= (expected_number_of_particles);
-                    fprintf(sys->weightedradial, "%lf\t%lf\n",BinSize*(I-1),\
-                            sys->boxes[I - 1]);
-                    diameter_of_previous_sphere++;//update sphere diameter
+                }
+            }
+            if(sys->debug_flag)
+            {
+                printf("dipole dipole = %lf\njust lj = %lf\n",correction,pe);
             }
+            pe += correction; 
         }
-	return;
+	return pe;//in KELVIN
 }
 
-void output(GCMC_System *sys, double accepted_energy)
+//a dipole mu_a at deltas from particle id_b
+static double dipole_pair(GCMC_System *sys, const double deltas[3],
+                          const double mu_a[3], int id_b)
 {
-        if(sys->energy_output_flag)
+        double r2 = deltas[0]*deltas[0] + deltas[1]*deltas[1] +
+                    deltas[2]*deltas[2];
+        if(r2 > sys->cutoff * sys->cutoff)
         {
-            fprintf(sys->energies, "%lf \n",accepted_energy);
+            return 0;
         }
-	int pool = sys->particles.size();
-        if(pool==0)
+        double mu_b[3] = {sys->particles.dipole[0][id_b],
+                          sys->particles.dipole[1][id_b],
+                          sys->particles.dipole[2][id_b]},
+               inverse_r2 = 1.0 / r2,
+               inverse_r3 = inverse_r2 * sqrt(inverse_r2),
+               inverse_r5 = inverse_r3 * inverse_r2,
+               a_dot_b = 0,
+               a_dot_r = 0,
+               b_dot_r = 0;
+        for(int p = 0;p<3;p++)
         {
-            return;
+            a_dot_b += mu_a[p] * mu_b[p];
+            a_dot_r += mu_a[p] * deltas[p];
+            b_dot_r += mu_b[p] * deltas[p];
         }
+        return a_dot_b * inverse_r3 - 3 * a_dot_r * b_dot_r * inverse_r5;
+}
 
-        if(sys->output_flag)
+/*******************************************************************************
+ * dipole_energy is the dipole-dipole interaction of particles a and b for
+ * Stockmayer fluids. The Lennard-Jones part of the pair lives in the kernels.
+ * calculate_PE sums the same term over every pair, so per-particle energies
+ * stay consistent with the total.
+ * ****************************************************************************/
+double dipole_energy(GCMC_System *sys, int id_a, int id_b)
+{
+        double deltas[3];
+        minimum_image(sys, id_a, id_b, deltas);
+        double mu_a[3] = {sys->particles.dipole[0][id_a],
+                          sys->particles.dipole[1][id_a],
+                          sys->particles.dipole[2][id_a]};
+        return dipole_pair(sys, deltas, mu_a, id_b);
+}
+
+//energy of one particle with every other particle inside the cutoff,
+//O(N) without the cell list and O(1) with it. It may come back as HUGE_VAL
+//instead once it is sure to be over limit, see bounded_kernel
+template<class Potential>
+double particle_energy(GCMC_System *sys, int id, double limit,
+                       pair_lists *lists)
+{
+        if(!Potential::interacts)
         {
-            if(sys->stockmayer_flag)
+            return 0;
+        }
+        //dipole pairs have no floor, so only a pure LJ sum can stop early
+        double pe = lj_particle_energy(sys, id, false,
+                                       Potential::dipoles ? HUGE_VAL : limit,
+                                       lists);
+        if(Potential::dipoles)
+        {
+            gather_neighbors(sys, id, lists);
+            for(int b : lists->neighbors)
             {
-                fprintf(sys->output,"ITEM: TIMESTEP\n"
-                                    "%d\n",sys->step);
-                fprintf(sys->output,"ITEM: NUMBER OF ATOMS\n"
-                                    "%d\n",(int)sys->particles.size());
-                fprintf(sys->output,"ITEM: BOX BOUNDS pp pp pp\n"
-                                   "0 %lf\n0 %lf\n0 %lf\n",\
-                                   sys->box_side_length,sys->box_side_length,\
-                                   sys->box_side_length);
-                fprintf(sys->output,"ITEM: ATOMS id type x y z mux muy muz\n");
-                for (int p = 0; p<pool; p++)
-                {
-                        fprintf(sys->output, "%d 6 %lf %lf %lf %lf %lf %lf\n",\
-                                p,sys->particles[p].x[0], sys->particles[p].x[1],\
-                                sys->particles[p].x[2],\
-                                sys->particles[p].dipole[0]/85.10597636,\
-                                sys->particles[p].dipole[1]/85.10597636,\
-                                sys->particles[p].dipole[2]/85.10597636);
-                }
+                pe += dipole_energy(sys, id, b);
             }
-            else
-            {
-                fprintf(sys->output,"%d\n\n",pool);
+        }
+        return pe;
+}
+
+//particle *context against the particles stored from begin to end, except
+//itself
+static double one_against_range(GCMC_System *sys, int begin, int end,
+                                const void *context, pair_lists *lists)
+{
+        particle_store * store = &sys->particles;
+        int id = *(const int*)context;
+        fixed_coord p[3] = {store->pos[0][id], store->pos[1][id],
+                            store->pos[2][id]};
+        int before = id < begin ? begin : (id < end ? id : end),
+            after = id < begin ? begin : (id < end ? id + 1 : end);
+        return sys->kernel(store->pos[0] + begin, store->pos[1] + begin,
+                           store->pos[2] + begin, before - begin, p, &sys->lj) +
+               sys->kernel(store->pos[0] + after, store->pos[1] + after,
+                           store->pos[2] + after, end - after, p, &sys->lj);
+}
+
+/*******************************************************************************
+ * bounded_kernel is sys->kernel for a sum that only matters if it comes out at
+ * most limit, which is what a trial move's energy is once its acceptance
+ * number has been drawn. It goes EARLY_CHUNK particles at a time and gives up,
+ * returning HUGE_VAL, as soon as what it has so far is too high for the rest
+ * to bring back under, since none of them can be below sys->lj.floor. In a
+ * dense fluid most insertions land on top of somebody, and that one pair is
+ * already more than all the others could make up for.
+ * ****************************************************************************/
+static double bounded_kernel(GCMC_System *sys, const fixed_coord *x,
+                             const fixed_coord *y, const fixed_coord *z, int n,
+                             const fixed_coord p[3], double limit)
+{
+        if(limit == HUGE_VAL)
+        {
+            return sys->kernel(x, y, z, n, p, &sys->lj);
+        }
+        double pe = 0.00;
+        for(int j = 0;j<n;j+=EARLY_CHUNK)
+        {
+            int chunk = n - j < EARLY_CHUNK ? n - j : EARLY_CHUNK;
+            pe += sys->kernel(x + j, y + j, z + j, chunk, p, &sys->lj);
+            if(pe + (n - j - chunk) * sys->lj.floor > limit)
+            {
+                return HUGE_VAL;
+            }
+        }
+        return pe;
+}
+
+//a particle at p against everyone stored but skip (-1 for none) when there is
+//no cell list, where they are already contiguous on either side of skip
+static double all_but_one(GCMC_System *sys, const fixed_coord p[3], int skip,
+                          double limit)
+{
+        particle_store * store = &sys->particles;
+        int before = skip < 0 ? store->count : skip,
+            after = skip < 0 ? 0 : store->count - before - 1;
+        //the later ones' floor is held back while the first ones are summed
+        double pe = bounded_kernel(sys, store->pos[0], store->pos[1],
+                                   store->pos[2], before, p,
+                                   limit - after * sys->lj.floor);
+        if(pe == HUGE_VAL)
+        {
+            return HUGE_VAL;
+        }
+        return pe + bounded_kernel(sys, store->pos[0] + before + 1,
+                                   store->pos[1] + before + 1,
+                                   store->pos[2] + before + 1, after, p,
+                                   limit - pe);
+}
+
+//the o-th of cell home and the 26 around it, home first
+static int cell_around(const cell_list *cells, int home, int o)
+{
+        int n = cells->cells_per_side,
+            d = (o + 13) % 27,//13 is no offset at all
+            cx = home / (n * n) + d / 9 - 1,
+            cy = (home / n) % n + (d / 3) % 3 - 1,
+            cz = home % n + d % 3 - 1;
+        return (((cx + n) % n) * n + (cy + n) % n) * n + (cz + n) % n;
+}
+
+/*******************************************************************************
+ * bounded_cells is the Lennard-Jones energy of a particle at p with everyone in
+ * cell home and the 26 around it but skip, for a sum that only matters if it
+ * is at most limit. Gathering the neighbours costs more than the kernel, so
+ * this goes a cell at a time, starting with home where an overlap is most
+ * likely, and only gathers a cell once it gets there; it gives up after any
+ * cell the way bounded_kernel does.
+ * ****************************************************************************/
+static double bounded_cells(GCMC_System *sys, int home, int skip,
+                            const fixed_coord p[3], double limit,
+                            pair_lists *lists)
+{
+        cell_list * cells = &sys->cells;
+        particle_store * store = &sys->particles;
+        int left = 0;//counting skip only loosens the bound
+        for(int o = 0;o<27;o++)
+        {
+            left += cells->members[cell_around(cells, home, o)].size();
+        }
+        double pe = 0.00;
+        for(int o = 0;o<27;o++)
+        {
+            const std::vector<int> & members =
+                cells->members[cell_around(cells, home, o)];
+            int n = 0;
+            for(int i = 0;i<3;i++)
+            {
+                lists->gathered[i].resize(members.size());
+            }
+            for(int b : members)
+            {
+                if(b == skip)
+                {
+                    continue;
+                }
+                lists->gathered[0][n] = store->pos[0][b];
+                lists->gathered[1][n] = store->pos[1][b];
+                lists->gathered[2][n] = store->pos[2][b];
+                n++;
+            }
+            left -= members.size();
+            pe += sys->kernel(lists->gathered[0].data(),
+                              lists->gathered[1].data(),
+                              lists->gathered[2].data(), n, p, &sys->lj);
+            if(pe + left * sys->lj.floor > limit)
+            {
+                return HUGE_VAL;
+            }
+        }
+        return pe;
+}
+
+/*******************************************************************************
+ * lj_particle_energy hands the Lennard-Jones part of particle id's energy to
+ * the SIMD kernel. Without a cell list the other particles are already sitting
+ * contiguously in the store on either side of id, and a big enough store gets
+ * split across the threads; with a cell list the neighbours' coordinates get
+ * packed into lists->gathered first. later_only counts only particles stored
+ * after id, which is how calculate_PE sees each pair once, and is the only
+ * form that can be called from a worker thread. A limit other than HUGE_VAL
+ * lets the sum stop early, see bounded_kernel, except when the threads are
+ * splitting it.
+ * ****************************************************************************/
+double lj_particle_energy(GCMC_System *sys, int id, bool later_only,
+                          double limit, pair_lists *lists)
+{
+        particle_store * store = &sys->particles;
+        fixed_coord p[3] = {store->pos[0][id], store->pos[1][id],
+                            store->pos[2][id]};
+        if(sys->cells.cells_per_side == 0)
+        {
+            if(!later_only && (limit == HUGE_VAL || sys->pool != NULL))
+            {
+                return parallel_sum(sys, store->count, MOVE_CHUNK,
+                                    one_against_range, &id);
+            }
+            if(!later_only)
+            {
+                return all_but_one(sys, p, id, limit);
+            }
+            return sys->kernel(store->pos[0] + id + 1, store->pos[1] + id + 1,
+                               store->pos[2] + id + 1, store->count - id - 1,
+                               p, &sys->lj);
+        }
+        if(limit != HUGE_VAL)
+        {
+            return bounded_cells(sys, sys->cells.cell_of[id], id, p, limit,
+                                 lists);
+        }
+        gather_neighbors(sys, id, lists);
+        int n = 0;
+        for(int i = 0;i<3;i++)
+        {
+            lists->gathered[i].resize(lists->neighbors.size());
+        }
+        for(int b : lists->neighbors)
+        {
+            if(later_only && b < id)
+            {
+                continue;
+            }
+            lists->gathered[0][n] = store->pos[0][b];
+            lists->gathered[1][n] = store->pos[1][b];
+            lists->gathered[2][n] = store->pos[2][b];
+            n++;
+        }
+        return sys->kernel(lists->gathered[0].data(), lists->gathered[1].data(),
+                           lists->gathered[2].data(), n, p, &sys->lj);
+}
+
+//fills in sys->lj once the box, cutoff and shift are known
+void set_lj_params(GCMC_System *sys)
+{
+        sys->lj.table = &sys->table;
+        sys->lj.scale = sys->box_side_length / FIXED_PER_BOX;
+        sys->lj.cutoff_squared = sys->cutoff * sys->cutoff;
+        sys->lj.sigma_sixth = sys->sigma_sixth;
+        sys->lj.four_epsilon = 4.0 * sys->epsilon;
+        sys->lj.shift = sys->energy_shift;
+        //LJ bottoms out at -epsilon at the well, and a table wherever it does
+        sys->lj.floor = sys->table.intervals > 0 ? sys->table.floor :
+                        fmin(0.0, -sys->epsilon - sys->energy_shift);
+}
+
+/*******************************************************************************
+ * check_drift compares the energy accumulated from per-move differences with a
+ * full recompute, warns if they have wandered apart, and returns the full
+ * value so round-off never builds up over a long run.
+ * ****************************************************************************/
+template<class Potential>
+double check_drift(GCMC_System *sys, double running_pe)
+{
+        double full_pe = calculate_PE<Potential>(sys),
+               drift = fabs(full_pe - running_pe);
+        if(drift > DRIFT_TOLERANCE * fmax(1.0, fabs(full_pe)))
+        {
+            printf("  Energy drift of %e K at step %d (running %lf, full %lf)\n",
+                   drift, sys->step, running_pe, full_pe);
+        }
+        return full_pe;
+}
+
+/*******************************************************************************
+ * tail_energy is the standard analytic correction for the LJ interactions past
+ * the cutoff, assuming g(r) = 1 out there:
+ *     U_tail = (8/3) pi N rho epsilon sigma^3 [ (sigma/rc)^9 / 3 - (sigma/rc)^3 ]
+ * It only depends on N and the volume, so inserting or deleting a particle
+ * changes it and that change has to be part of the acceptance.
+ * ****************************************************************************/
+double tail_energy(GCMC_System *sys, int n)
+{
+        if(!sys->tail_flag || sys->ideal_flag)
+        {
+            return 0;
+        }
+        double sr3 = pow(sys->sigma / sys->cutoff, 3),
+               sr9 = sr3 * sr3 * sr3,
+               sigma_cubed = sys->sigma_squared * sys->sigma;
+        return (8.0 / 3.0) * M_PI * n * n / sys->volume * sys->epsilon *
+               sigma_cubed * (sr9 / 3.0 - sr3);
+}
+
+//pressure correction to go with tail_energy, in K/A^3
+double tail_pressure(GCMC_System *sys, double density)
+{
+        if(!sys->tail_flag || sys->ideal_flag)
+        {
+            return 0;
+        }
+        double sr3 = pow(sys->sigma / sys->cutoff, 3),
+               sr9 = sr3 * sr3 * sr3,
+               sigma_cubed = sys->sigma_squared * sys->sigma;
+        return (16.0 / 3.0) * M_PI * density * density * sys->epsilon *
+               sigma_cubed * ((2.0 / 3.0) * sr9 - sr3);
+}
+
+//the following is the minimum image convention, one coordinate at a time:
+//the fixed point difference wraps around, and as a signed int it is already
+//the shortest way from b to a
+void minimum_image(GCMC_System *sys, int id_a, int id_b, double deltas[3])
+{
+	for(int i = 0; i<3; i++)
+	{
+		int32_t delta = (int32_t)(sys->particles.pos[i][id_a] -
+                                          sys->particles.pos[i][id_b]);
+                deltas[i] = delta * sys->lj.scale;
+	}
+}
+
+double distfinder(GCMC_System *sys, int id_a, int id_b)
+{
+	double deltas[3];
+        minimum_image(sys, id_a, id_b, deltas);
+        //distance requires sum of squares of distance in each
+        //coordinate direction
+	return sqrt(deltas[0]*deltas[0] + deltas[1]*deltas[1] +
+                    deltas[2]*deltas[2]);
+}
+
+/*******************************************************************************
+ * build_cells sizes the cell list from the cutoff and sorts every particle into
+ * it. Cells have to be at least a cutoff wide, and with fewer than three per
+ * side the 27 neighbouring cells would wrap onto each other, so small boxes
+ * just loop over everybody.
+ * ****************************************************************************/
+void build_cells(GCMC_System *sys)
+{
+        const fixed_coord unshifted[3] = {0, 0, 0};
+        shift_cells(sys, unshifted);
+}
+
+/*******************************************************************************
+ * shift_cells rebuilds the cell list with the grid moved by offset, so that
+ * checkerboard sweeps don't always cut the box in the same places. Those need
+ * an even number of cells per side, so the colours alternate all the way
+ * around, and at least four of them.
+ * ****************************************************************************/
+void shift_cells(GCMC_System *sys, const fixed_coord offset[3])
+{
+        cell_list * cells = &sys->cells;
+        cells->cells_per_side = (int)(sys->box_side_length / sys->cutoff);
+        if(sys->checkerboard_flag)
+        {
+            cells->cells_per_side -= cells->cells_per_side % 2;
+        }
+        if(cells->cells_per_side < 3 ||
+           (sys->checkerboard_flag && cells->cells_per_side < 4))
+        {
+            cells->cells_per_side = 0;
+            return;
+        }
+        for(int i = 0;i<3;i++)
+        {
+            cells->offset[i] = offset[i];
+        }
+        int n = cells->cells_per_side;
+        //emptying the cells keeps their memory for when they fill back up
+        cells->members.resize(n * n * n);
+        for(std::vector<int> & members : cells->members)
+        {
+            members.clear();
+        }
+        cells->cell_of.clear();
+        cells->slot_of.clear();
+        int pool = sys->particles.count;
+        for(int p = 0;p<pool;p++)
+        {
+            cell_insert(sys, p);
+        }
+}
+
+//spreads the low 21 bits of v out to every third bit
+static uint64_t spread_bits(uint64_t v)
+{
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffULL;
+        v = (v | v << 16) & 0x1f0000ff0000ffULL;
+        v = (v | v << 8) & 0x100f00f00f00f00fULL;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+        v = (v | v << 2) & 0x1249249249249249ULL;
+        return v;
+}
+
+//position of a particle along a Morton (Z order) curve through the box, from
+//the top 21 bits of each coordinate
+static uint64_t morton_key(const particle_store *store, int slot)
+{
+        return spread_bits(store->pos[0][slot] >> 11) << 2 |
+               spread_bits(store->pos[1][slot] >> 11) << 1 |
+               spread_bits(store->pos[2][slot] >> 11);
+}
+
+/*******************************************************************************
+ * reorder_particles sorts the store along a Morton curve, so particles that
+ * are close in space are close in memory too. Inserts and deletes scatter them
+ * again over time, so this is called every so often between moves (never with
+ * a move waiting to be undone). The cell list is rebuilt afterwards, which
+ * also leaves every cell's members in curve order.
+ * ****************************************************************************/
+void reorder_particles(GCMC_System *sys)
+{
+        particle_store * store = &sys->particles;
+        std::pair<uint64_t, int> * keys = (std::pair<uint64_t, int>*)
+            arena_alloc(&sys->scratch, store->count * sizeof(*keys));
+        int * order = (int*)arena_alloc(&sys->scratch,
+                                        store->count * sizeof(int));
+        for(int s = 0;s<store->count;s++)
+        {
+            keys[s] = std::make_pair(morton_key(store, s), s);
+        }
+        std::sort(keys, keys + store->count);
+        for(int s = 0;s<store->count;s++)
+        {
+            order[s] = keys[s].second;
+        }
+        store_permute(store, order, arena_alloc(&sys->scratch,
+                                                store->count * sizeof(double)));
+        build_cells(sys);
+}
+
+//which cell the point p is in
+int cell_at(GCMC_System *sys, const fixed_coord p[3])
+{
+        int n = sys->cells.cells_per_side,
+            c[3];
+        //the coordinate is a fraction of 2^32, so this is floor(fraction * n)
+        for(int i = 0;i<3;i++)
+        {
+            fixed_coord shifted = p[i] + sys->cells.offset[i];
+            c[i] = (int)(((uint64_t)shifted * n) >> 32);
+        }
+        return (c[0] * n + c[1]) * n + c[2];
+}
+
+//which cell a particle's coordinates put it in
+int cell_index(GCMC_System *sys, int id)
+{
+        fixed_coord p[3] = {sys->particles.pos[0][id], sys->particles.pos[1][id],
+                            sys->particles.pos[2][id]};
+        return cell_at(sys, p);
+}
+
+void cell_insert(GCMC_System *sys, int id)
+{
+        cell_list * cells = &sys->cells;
+        if(cells->cells_per_side == 0)
+        {
+            return;
+        }
+        if((int)cells->cell_of.size() <= id)
+        {
+            cells->cell_of.resize(id + 1);
+            cells->slot_of.resize(id + 1);
+        }
+        int c = cell_index(sys, id);
+        cells->cell_of[id] = c;
+        cells->slot_of[id] = cells->members[c].size();
+        cells->members[c].push_back(id);
+}
+
+//swaps the particle with the last one in its cell so removal is O(1)
+void cell_remove(GCMC_System *sys, int id)
+{
+        cell_list * cells = &sys->cells;
+        if(cells->cells_per_side == 0)
+        {
+            return;
+        }
+        std::vector<int> * members = &cells->members[cells->cell_of[id]];
+        int slot = cells->slot_of[id],
+            last = members->back();
+        (*members)[slot] = last;
+        cells->slot_of[last] = slot;
+        members->pop_back();
+}
+
+//call after a particle's coordinates change
+void cell_update(GCMC_System *sys, int id)
+{
+        if(sys->cells.cells_per_side == 0 ||
+           cell_index(sys, id) == sys->cells.cell_of[id])
+        {
+            return;
+        }
+        cell_remove(sys, id);
+        cell_insert(sys, id);
+}
+
+//the particle in slot "from" has been moved to slot "to" by the store
+void cell_relabel(GCMC_System *sys, int from, int to)
+{
+        cell_list * cells = &sys->cells;
+        if(cells->cells_per_side == 0)
+        {
+            return;
+        }
+        if((int)cells->cell_of.size() <= to)
+        {
+            cells->cell_of.resize(to + 1);
+            cells->slot_of.resize(to + 1);
+        }
+        cells->cell_of[to] = cells->cell_of[from];
+        cells->slot_of[to] = cells->slot_of[from];
+        cells->members[cells->cell_of[to]][cells->slot_of[to]] = to;
+}
+
+//fills lists->neighbors with every particle that could be within the cutoff
+//of particle id (not including id itself)
+void gather_neighbors(GCMC_System *sys, int id, pair_lists *lists)
+{
+        cell_list * cells = &sys->cells;
+        if(cells->cells_per_side == 0)
+        {
+            std::vector<int> * neighbors = &lists->neighbors;
+            neighbors->clear();
+            int pool = sys->particles.count;
+            for(int b = 0;b<pool;b++)
+            {
+                if(b != id)
+                {
+                    neighbors->push_back(b);
+                }
+            }
+            return;
+        }
+        gather_cell(sys, cells->cell_of[id], id, lists);
+}
+
+//fills lists->neighbors with the particles in cell home and the 26 around it,
+//leaving out skip
+void gather_cell(GCMC_System *sys, int home, int skip, pair_lists *lists)
+{
+        cell_list * cells = &sys->cells;
+        std::vector<int> * neighbors = &lists->neighbors;
+        neighbors->clear();
+        int n = cells->cells_per_side,
+            cx = home / (n * n),
+            cy = (home / n) % n,
+            cz = home % n;
+        for(int dx = -1;dx<=1;dx++)
+        {
+            for(int dy = -1;dy<=1;dy++)
+            {
+                for(int dz = -1;dz<=1;dz++)
+                {
+                    int c = ((((cx + dx + n) % n) * n + (cy + dy + n) % n) * n
+                             + (cz + dz + n) % n);
+                    for(int b : cells->members[c])
+                    {
+                        if(b != skip)
+                        {
+                            neighbors->push_back(b);
+                        }
+                    }
+                }
+            }
+        }
+}
+
+//Philox4x32 round multipliers and key increments (Salmon et al., SC11)
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+#define RNG_BLOCKS (RNG_BATCH / 2)//two doubles out of each 128 bit block
+
+//starts stream number stream of the streams belonging to key
+void rng_seed(split_rng *rng, uint64_t key, uint64_t stream)
+{
+        rng->key = key;
+        rng->stream = stream;
+        rng->block = 0;
+        rng->next = RNG_BATCH;//nothing made yet
+}
+
+/*******************************************************************************
+ * rng_refill makes the next RNG_BLOCKS Philox blocks at once. The counter is
+ * the block number in its low 64 bits and the stream in its high 64, and the
+ * blocks are independent, so the round loop runs across all of them together.
+ * ****************************************************************************/
+static void rng_refill(split_rng *rng)
+{
+        uint32_t c0[RNG_BLOCKS], c1[RNG_BLOCKS], c2[RNG_BLOCKS], c3[RNG_BLOCKS],
+                 k0 = (uint32_t)rng->key,
+                 k1 = (uint32_t)(rng->key >> 32);
+        for(int b = 0;b<RNG_BLOCKS;b++)
+        {
+            uint64_t block = rng->block + b;
+            c0[b] = (uint32_t)block;
+            c1[b] = (uint32_t)(block >> 32);
+            c2[b] = (uint32_t)rng->stream;
+            c3[b] = (uint32_t)(rng->stream >> 32);
+        }
+        for(int round = 0;round<PHILOX_ROUNDS;round++)
+        {
+            for(int b = 0;b<RNG_BLOCKS;b++)
+            {
+                uint64_t p0 = (uint64_t)PHILOX_M0 * c0[b],
+                         p1 = (uint64_t)PHILOX_M1 * c2[b];
+                uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1[b] ^ k0,
+                         n2 = (uint32_t)(p0 >> 32) ^ c3[b] ^ k1;
+                c0[b] = n0;
+                c1[b] = (uint32_t)p1;
+                c2[b] = n2;
+                c3[b] = (uint32_t)p0;
+            }
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        //the top 53 of each 64 bits, scaled into [0,1)
+        for(int b = 0;b<RNG_BLOCKS;b++)
+        {
+            rng->batch[2*b] = (((uint64_t)c0[b] << 21) | (c1[b] >> 11)) *
+                              (1.0 / 9007199254740992.0);
+            rng->batch[2*b+1] = (((uint64_t)c2[b] << 21) | (c3[b] >> 11)) *
+                                (1.0 / 9007199254740992.0);
+        }
+        rng->block += RNG_BLOCKS;
+        rng->next = 0;
+}
+
+//uniform in [0,1)
+double rng_uniform(split_rng *rng)
+{
+        if(rng->next == RNG_BATCH)
+        {
+            rng_refill(rng);
+        }
+        return rng->batch[rng->next++];
+}
+
+//return a random double between min and max, from sys's own stream
+double random_range(GCMC_System *sys, double min, double max)
+{
+	return min + rng_uniform(&sys->rng) * (max - min);
+}
+
+//a random whole number from 0 to n-1
+int random_index(GCMC_System *sys, int n)
+{
+        return (int)(rng_uniform(&sys->rng) * n);
+}
+
+//a seed for when -seed isn't given, different for runs started together
+uint64_t random_seed()
+{
+        std::random_device device;
+        return ((uint64_t)device() << 32) ^ device() ^ (uint64_t)time(NULL);
+}
+
+template<class Potential, class Ensemble>
+MoveType make_move(GCMC_System *sys)
+{
+        //MoveType is an enum in MonteCarlo.h 
+	MoveType move;
+	int pool = sys->particles.count;
+        if(Ensemble::scales && random_range(sys, 0,1) < VOLUME_MOVE_FRACTION)
+        {
+            change_volume<Potential>(sys);
+            move = CHANGE_VOLUME;
+        }
+        else if(!Ensemble::exchanges)
+        {
+            double pick = random_index(sys, pool);
+            move_particle<Potential>(sys,pick);
+            move = TRANSLATE;
+        }
+        else
+        {
+            if (pool == 0)
+            {
+                    create_particle<Potential>(sys);
+                    pool = sys->particles.count;
+                    move = CREATE_PARTICLE;
+            }
+            else
+            {
+                double pick = random_index(sys, pool),//picks random particle
+                       choice = random_range(sys, 0,1),//random float between 0 and 1
+                       exchange = sys->tuning.exchange_fraction;
+                fflush(stdout);
+                //creates and destroys always equally likely
+                if (choice<0.5*exchange)
+                {
+                        create_particle<Potential>(sys);
+                        move = CREATE_PARTICLE;
+                }
+                else if (choice >= exchange)
+                {
+                        move_particle<Potential>(sys,pick);
+                        move = TRANSLATE;
+                }
+                else
+                {
+                        destroy_particle<Potential>(sys, pick);
+                        move = DESTROY_PARTICLE;
+                }
+            }
+        }
+	return move;
+}
+
+
+//uniformly random direction on the sphere, scaled to the dipole magnitude
+void pick_dipole_direction(GCMC_System *sys, double dipole[3])
+{
+    double theta = random_range(sys, 0,2*M_PI),
+           z = random_range(sys, -1,1),
+           x = sqrt(1-(z*z)) * cos(theta),
+           y = sqrt(1-(z*z)) * sin(theta);
+    dipole[0] = x * sys->dipole_magnitude;
+    dipole[1] = y * sys->dipole_magnitude;
+    dipole[2] = z * sys->dipole_magnitude;
+}
+
+//turns dipole by a random angle of at most max_angle, uniformly over that cap
+//of the sphere around where it points, so turning back is just as likely
+void turn_dipole(GCMC_System *sys, double dipole[3], double max_angle)
+{
+    double length = sqrt(dipole[0]*dipole[0] + dipole[1]*dipole[1] +
+                         dipole[2]*dipole[2]),
+           u[3] = {dipole[0]/length, dipole[1]/length, dipole[2]/length},
+           cos_theta = 1 - random_range(sys, 0,1) * (1 - cos(max_angle)),
+           sin_theta = sqrt(fmax(0.0, 1 - cos_theta*cos_theta)),
+           phi = random_range(sys, 0,2*M_PI);
+    //two unit vectors at right angles to u and to each other
+    double a[3] = {0, 0, 0};
+    a[fabs(u[0]) < 0.9 ? 0 : 1] = 1;
+    double along = a[0]*u[0] + a[1]*u[1] + a[2]*u[2],
+           e1[3] = {a[0] - along*u[0], a[1] - along*u[1], a[2] - along*u[2]},
+           e1_length = sqrt(e1[0]*e1[0] + e1[1]*e1[1] + e1[2]*e1[2]);
+    for(int i = 0;i<3;i++)
+    {
+        e1[i] /= e1_length;
+    }
+    double e2[3] = {u[1]*e1[2] - u[2]*e1[1],
+                    u[2]*e1[0] - u[0]*e1[2],
+                    u[0]*e1[1] - u[1]*e1[0]};
+    for(int i = 0;i<3;i++)
+    {
+        dipole[i] = length * (cos_theta * u[i] + sin_theta *
+                              (cos(phi) * e1[i] + sin(phi) * e2[i]));
+    }
+}
+
+
+//puts n particles on a simple cubic lattice filling the box; the cell list
+//has to be built afterwards
+void place_lattice(GCMC_System *sys, int n)
+{
+        int side = (int)ceil(cbrt((double)n));
+        double spacing = sys->box_side_length / side;
+        for(int p = 0;p<n;p++)
+        {
+            particle added = {};
+            added.id = -1;
+            added.x[0] = (p % side + 0.5) * spacing;
+            added.x[1] = (p / side % side + 0.5) * spacing;
+            added.x[2] = (p / (side * side) + 0.5) * spacing;
+            if(sys->stockmayer_flag)
+            {
+                pick_dipole_direction(sys, added.dipole);
+            }
+            store_insert(&sys->particles, &added);
+        }
+}
+
+//insert particle at random location
+template<class Potential>
+void create_particle( GCMC_System *sys)
+{
+    //we make a struct of type "particle"
+    particle to_be_inserted = {}; 
+    to_be_inserted.id = -1;//the store hands out the id
+    //we create random coordinates for the particle 
+    to_be_inserted.x[0] = random_range(sys, 0,sys->box_side_length);
+    to_be_inserted.x[1] = random_range(sys, 0,sys->box_side_length);
+    to_be_inserted.x[2] = random_range(sys, 0,sys->box_side_length);
+
+    if(Potential::dipoles)
+    {
+        pick_dipole_direction(sys, to_be_inserted.dipole);
+    }
+    //we add the particle to the store that holds all our particles
+    cell_insert(sys, store_insert(&sys->particles, &to_be_inserted));
+    //the new particle's interactions are the whole energy change
+    int pool = sys->particles.count;
+    sys->delta_pe = 0;
+    if(Potential::interacts)
+    {
+        double tail = tail_energy(sys, pool) - tail_energy(sys, pool - 1),
+               limit = rejection_limit(sys, acceptance_ratio(sys, 0,
+                                                             CREATE_PARTICLE,
+                                                             pool),
+                                       sys->uniform) - tail;
+        sys->delta_pe = particle_energy<Potential>(sys, pool - 1, limit,
+                                                   &sys->lists[0]) + tail;
+    }
+    return;
+}
+
+
+//Displace a random particle a random distance
+template<class Potential>
+void move_particle(GCMC_System *sys, int pick)
+{
+        double reach = displacement_reach(sys),//half the box untuned
+               old_pe = particle_energy<Potential>(sys, pick, HUGE_VAL,
+                                                   &sys->lists[0]);
+        double phi = random_range(sys, -reach,reach),
+               gamma = random_range(sys, -reach,reach), 
+               delta = random_range(sys, -reach,reach);
+        //store displacement in case it needs to be undone
+        sys->move.pick = pick;
+        sys->move.phi = to_fixed(&sys->particles, phi);
+        sys->move.gamma = to_fixed(&sys->particles, gamma);
+        sys->move.delta = to_fixed(&sys->particles, delta);
+        //make the moves; leaving the box just wraps around to the other side
+        sys->particles.pos[0][pick] += sys->move.phi;
+        sys->particles.pos[1][pick] += sys->move.gamma;
+        sys->particles.pos[2][pick] += sys->move.delta;
+        cell_update(sys, pick);
+        if(Potential::dipoles)
+        {
+            sys->move.dipole[0] = sys->particles.dipole[0][pick];
+            sys->move.dipole[1] = sys->particles.dipole[1][pick];
+            sys->move.dipole[2] = sys->particles.dipole[2][pick];
+
+            double dipole[3] = {sys->move.dipole[0], sys->move.dipole[1],
+                                sys->move.dipole[2]};
+            if(sys->tuning.max_rotation < M_PI)
+            {
+                turn_dipole(sys, dipole, sys->tuning.max_rotation);
+            }
+            else
+            {
+                pick_dipole_direction(sys, dipole);
+            }
+            sys->particles.dipole[0][pick] = dipole[0];
+            sys->particles.dipole[1][pick] = dipole[1];
+            sys->particles.dipole[2][pick] = dipole[2];
+        }
+        //past this the move can't be accepted, so the sum can stop there
+        double limit = old_pe + rejection_limit(sys, 1.0, sys->uniform);
+        sys->delta_pe = particle_energy<Potential>(sys, pick, limit,
+                                                   &sys->lists[0]) - old_pe;
+	return;
+}
+
+//particle deletion
+template<class Potential>
+void destroy_particle(GCMC_System *sys, int pick)
+{
+	sys->destroy.pick = pick;
+	store_get(&sys->particles, pick, &sys->destroy.removed);
+        //removing the particle takes away all of its interactions
+        int pool = sys->particles.count;
+        sys->delta_pe = 0;
+        if(Potential::interacts)
+        {
+            sys->delta_pe = -particle_energy<Potential>(sys, pick, HUGE_VAL,
+                                                        &sys->lists[0]) +
+                            tail_energy(sys, pool - 1) - tail_energy(sys, pool);
+        }
+	cell_remove(sys, pick);
+	int moved = store_remove(&sys->particles, pick);
+	if(moved != pick)
+	{
+		cell_relabel(sys, moved, pick);
+	}
+        return;
+}
+
+
+//the Metropolis ratio for a move with energy change delta, where pool is the
+//number of particles once the move is made
+double acceptance_ratio(GCMC_System *sys, double delta, MoveType move_type,
+                        int pool)
+{
+        double e = M_E,
+               beta = 1.0 / (k * sys->system_temp),//thermodynamic beta
+               volume = sys->volume,
+               boltzmann_factor = pow(e,(-beta*delta));
+	if (move_type == CREATE_PARTICLE)
+	{
+                return boltzmann_factor* volume * sys->pressure * conv_factor / \
+                       (sys->system_temp * (double)pool);
+	}
+	else if (move_type == DESTROY_PARTICLE )//if we DESTROYED a particle
+	{
+                return boltzmann_factor * sys->system_temp * \
+                       (double)(pool + 1) / (volume * sys->pressure * conv_factor);
+	}
+	else if (move_type == CHANGE_VOLUME)//a random walk in ln V at pressure P
+	{
+                double old_volume = sys->resize.volume;
+                return boltzmann_factor *
+                       exp(-beta * sys->pressure * conv_factor *
+                           (volume - old_volume)) *
+                       pow(volume / old_volume, pool + 1);
+	}
+	return boltzmann_factor;//translations
+}
+
+/*******************************************************************************
+ * rejection_limit turns a move's acceptance number into the largest energy
+ * change that still gets it accepted. Every acceptance ratio is exp(-beta
+ * delta) times a prefactor that doesn't depend on the energy, so ratio >
+ * uniform is delta < kT (ln prefactor - ln uniform). It is HUGE_VAL, sum
+ * everything, with -tmmc, whose collection matrix needs every move's real
+ * ratio.
+ * ****************************************************************************/
+double rejection_limit(GCMC_System *sys, double prefactor, double uniform)
+{
+        if(sys->tmmc.max_particles > 0 || uniform <= 0)
+        {
+            return HUGE_VAL;
+        }
+        return k * sys->system_temp * (log(prefactor) - log(uniform));
+}
+
+//checks a move against the acceptance number mc_step drew before making it
+bool move_accepted(double cpe, double npe, MoveType move_type,\
+                   GCMC_System *sys)
+{
+        double random = sys->uniform,
+               ratio = acceptance_ratio(sys, npe - cpe, move_type,
+                                        sys->particles.count);
+        if(sys->tmmc.max_particles > 0)
+        {
+            ratio = tmmc_collect(sys, ratio, move_type);
+        }
+        return ratio > random;
+}
+
+//undoes rejected moves based on move types
+template<class Potential>
+void undo_move(GCMC_System *sys, MoveType move)
+{
+	if (move == CREATE_PARTICLE)
+	{
+	        undo_insertion(sys);	
+	}
+	else if (move == TRANSLATE)
+	{
+		unmove_particle<Potential>(sys);
+	}
+	else if (move == CHANGE_VOLUME)
+	{
+		scale_box(sys, sys->resize.side, sys->resize.cutoff);
+		sys->moments = sys->resize.moments;
+	}
+	else
+	{
+		//put the particle back in its old slot with its old id
+		int pick = sys->destroy.pick,
+		    last = sys->particles.count;
+		store_restore(&sys->particles, pick, &sys->destroy.removed);
+		if(pick != last)
+		{
+			cell_relabel(sys, pick, last);
+		}
+		cell_insert(sys, pick);
+	}
+	return;
+}
+
+void undo_insertion(GCMC_System *sys)
+{
+    cell_remove(sys, sys->particles.count - 1);
+    store_remove(&sys->particles, sys->particles.count - 1);
+}
+
+
+//undoes a rejected displacement
+template<class Potential>
+void unmove_particle(GCMC_System *sys)
+{
+	int pick = sys->move.pick;
+        //integer wraparound makes this exact, boundary or not
+	sys->particles.pos[0][pick] -= sys->move.phi;
+	sys->particles.pos[1][pick] -= sys->move.gamma;
+	sys->particles.pos[2][pick] -= sys->move.delta;
+        cell_update(sys, pick);
+        if(Potential::dipoles)
+        {
+            sys->particles.dipole[0][pick] = sys->move.dipole[0];
+            sys->particles.dipole[1][pick] = sys->move.dipole[1];
+            sys->particles.dipole[2][pick] = sys->move.dipole[2];
+        }
+	return;
+}
+
+double sphere_volume(GCMC_System *sys,double diameter)
+{
+        diameter = diameter*sys->BinSize;//weighting
+	double radius = diameter;//this is important!
+        return (4.0 / 3.0) * M_PI * radius * radius * radius;
+}
+
+
+//bins the pairs of particles begin to end with those stored after them into
+//this thread's histogram, and returns how many pairs that was
+static double bin_pairs(GCMC_System *sys, int begin, int end,
+                        const void *context, pair_lists *lists)
+{
+	int IK,
+            num_pairs = 0;
+	double dist;
+        lists->bins.resize(sys->nBins);
+	for (int I = begin; I<end; I++)
+	{
+                gather_neighbors(sys, I, lists);
+		for (int K : lists->neighbors)
+		{
+                    if(K < I)
+                    {
+                        continue;//each pair once
+                    }
+                    dist = distfinder(sys, I, K);
+                    if(dist>sys->cutoff)
+                    {
+                        continue;
+                    }
+                    IK = int(dist / sys->BinSize);
+                    if(IK >= sys->nBins)
+                    {
+                        continue;//an NPT box can grow past the histogram
+                    }
+                    num_pairs+=1;
+                    lists->bins[IK] += 2;
+		}
+	}
+        return num_pairs;
+}
+
+void radialDistribution(GCMC_System *sys,int step)
+{
+        parallel_sum(sys, sys->particles.count, ENERGY_CHUNK, bin_pairs, NULL);
+        //the counts are whole numbers, so adding the threads' histograms in
+        //any order gives exactly the same totals
+        for(pair_lists & lists : sys->lists)
+        {
+            for(int b = 0;b<(int)lists.bins.size();b++)
+            {
+                sys->boxes[b] += lists.bins[b];
+                lists.bins[b] = 0;
+            }
+        }
+	return;
+}
+
+//normalizes the g(r) histogram over the production phase and writes it out,
+//once the run is over
+void write_radial(GCMC_System *sys)
+{
+	const int nBins = sys->nBins; //total number of bins
+	double  BinSize = sys->BinSize,
+		expected_number_of_particles,
+		diameter_of_current_sphere,
+	        diameter_of_previous_sphere,
+		shell_volume;
+	diameter_of_previous_sphere = 0;
+        double real_density_hours = (sys->sumparticles/sys->production_steps)/sys->volume;
+        for (int I = 1; I <= nBins; I++)
+        {
+                sys->boxes[I-1] /=  sys->production_steps;
+                sys->boxes[I-1] /= sys->sumparticles/sys->production_steps;
+                fprintf(sys->unweightedradial, "%lf\t%lf\n",BinSize*(I-1),\
+                        sys->boxes[I - 1]);
+                diameter_of_current_sphere = I;
+                shell_volume = sphere_volume(sys,diameter_of_current_sphere)
+                           - sphere_volume(sys,diameter_of_previous_sphere);
+                expected_number_of_particles = shell_volume * real_density_hours;
+                sys->boxes[I - 1] /= (expected_number_of_particles);
+                fprintf(sys->weightedradial, "%lf\t%lf\n",BinSize*(I-1),\
+                        sys->boxes[I - 1]);
+                diameter_of_previous_sphere++;//update sphere diameter
+        }
+	return;
+}
+
+void output(GCMC_System *sys, double accepted_energy)
+{
+        if(sys->energy_output_flag)
+        {
+            fprintf(sys->energies, "%lf \n",accepted_energy);
+        }
+	int pool = sys->particles.count;
+        if(pool==0)
+        {
+            return;
+        }
+
+        if(sys->output_flag)
+        {
+            if(sys->stockmayer_flag)
+            {
+                fprintf(sys->output,"ITEM: TIMESTEP\n"
+                                    "%d\n",sys->step);
+                fprintf(sys->output,"ITEM: NUMBER OF ATOMS\n"
+                                    "%d\n",(int)sys->particles.count);
+                fprintf(sys->output,"ITEM: BOX BOUNDS pp pp pp\n"
+                                   "0 %lf\n0 %lf\n0 %lf\n",\
+                                   sys->box_side_length,sys->box_side_length,\
+                                   sys->box_side_length);
+                fprintf(sys->output,"ITEM: ATOMS id type x y z mux muy muz\n");
+                for (int p = 0; p<pool; p++)
+                {
+                        fprintf(sys->output, "%d 6 %lf %lf %lf %lf %lf %lf\n",\
+                                sys->particles.id[p],\
+                                to_angstroms(&sys->particles,
+                                             sys->particles.pos[0][p]),\
+                                to_angstroms(&sys->particles,
+                                             sys->particles.pos[1][p]),\
+                                to_angstroms(&sys->particles,
+                                             sys->particles.pos[2][p]),\
+                                sys->particles.dipole[0][p]/85.10597636,\
+                                sys->particles.dipole[1][p]/85.10597636,\
+                                sys->particles.dipole[2][p]/85.10597636);
+                }
+            }
+            else
+            {
+                fprintf(sys->output,"%d\n\n",pool);
                 for(int p=0;p<pool;p++)
                 {
-                    fprintf(sys->output,"%s %lf %lf %lf\n", sys->particle_type,
-                            sys->particles[p].x[0], sys->particles[p].x[1],
-                            sys->particles[p].x[2]);
+                    fprintf(sys->output,"%s %lf %lf %lf\n", sys->particle_type,
+                            to_angstroms(&sys->particles, sys->particles.pos[0][p]),
+                            to_angstroms(&sys->particles, sys->particles.pos[1][p]),
+                            to_angstroms(&sys->particles, sys->particles.pos[2][p]));
+                }
+            }
+        }
+	return;
+}
+
+/*******************************************************************************
+ * NPT. A volume move scales the whole box, cutoff included, so every pair
+ * distance scales by the same factor s and no pair crosses the cutoff. The
+ * Lennard-Jones energy afterwards follows from the box's lj_moments alone,
+ * 4 epsilon (s^-12 sum (sigma/r)^12 - s^-6 sum (sigma/r)^6) minus the new shift
+ * for every pair, and point dipoles scale as s^-3, so a volume move costs the
+ * same however many particles there are. The moments are kept up to date by
+ * adding the change from each accepted translation, and recomputed whenever
+ * the energy is checked for drift.
+ * ****************************************************************************/
+
+//the moments of a particle at p with everyone except skip, added to sum
+static void point_moments(GCMC_System *sys, const fixed_coord p[3], int skip,
+                          pair_lists *lists, lj_moments *sum)
+{
+        particle_store * store = &sys->particles;
+        if(sys->cells.cells_per_side == 0)
+        {
+            int before = skip < 0 ? store->count : skip,
+                after = skip < 0 ? store->count : skip + 1;
+            lj_moments_scalar(store->pos[0], store->pos[1], store->pos[2],
+                              before, p, &sys->lj, sum);
+            lj_moments_scalar(store->pos[0] + after, store->pos[1] + after,
+                              store->pos[2] + after, store->count - after, p,
+                              &sys->lj, sum);
+            return;
+        }
+        gather_cell(sys, cell_at(sys, p), skip, lists);
+        int n = lists->neighbors.size();
+        for(int i = 0;i<3;i++)
+        {
+            lists->gathered[i].resize(n);
+            for(int j = 0;j<n;j++)
+            {
+                lists->gathered[i][j] = store->pos[i][lists->neighbors[j]];
+            }
+        }
+        lj_moments_scalar(lists->gathered[0].data(), lists->gathered[1].data(),
+                          lists->gathered[2].data(), n, p, &sys->lj, sum);
+}
+
+//the moments of the whole box, each pair once
+static lj_moments total_moments(GCMC_System *sys)
+{
+        particle_store * store = &sys->particles;
+        pair_lists * lists = &sys->lists[0];
+        lj_moments sum = {0, 0, 0};
+        for(int a = 0;a<store->count;a++)
+        {
+            fixed_coord p[3] = {store->pos[0][a], store->pos[1][a],
+                                store->pos[2][a]};
+            if(sys->cells.cells_per_side == 0)
+            {
+                lj_moments_scalar(store->pos[0] + a + 1, store->pos[1] + a + 1,
+                                  store->pos[2] + a + 1, store->count - a - 1,
+                                  p, &sys->lj, &sum);
+                continue;
+            }
+            gather_neighbors(sys, a, lists);
+            int n = 0;
+            for(int i = 0;i<3;i++)
+            {
+                lists->gathered[i].resize(lists->neighbors.size());
+            }
+            for(int b : lists->neighbors)
+            {
+                if(b > a)
+                {
+                    for(int i = 0;i<3;i++)
+                    {
+                        lists->gathered[i][n] = store->pos[i][b];
+                    }
+                    n++;
+                }
+            }
+            lj_moments_scalar(lists->gathered[0].data(),
+                              lists->gathered[1].data(),
+                              lists->gathered[2].data(), n, p, &sys->lj, &sum);
+        }
+        return sum;
+}
+
+//the Lennard-Jones energy the box's moments add up to
+static double moments_energy(GCMC_System *sys)
+{
+        return 4.0 * sys->epsilon * (sys->moments.twelfth - sys->moments.sixth) -
+               sys->energy_shift * sys->moments.pairs;
+}
+
+//changes the box to side and the cutoff to cutoff without moving the cells,
+//which scale along with everything else
+void scale_box(GCMC_System *sys, double side, double cutoff)
+{
+        sys->box_side_length = side;
+        sys->half_box = side * .5;
+        sys->volume = side * side * side;
+        sys->particles.box_side_length = side;
+        sys->cutoff = cutoff;
+        if(sys->shift_flag)
+        {
+            double sr6 = sys->sigma_sixth / pow(cutoff, 6);
+            sys->energy_shift = 4.0 * sys->epsilon * (sr6 * sr6 - sr6);
+        }
+        set_lj_params(sys);
+}
+
+//a random walk in ln V of up to volume_step either way, scaling everything
+template<class Potential>
+void change_volume(GCMC_System *sys)
+{
+        int pool = sys->particles.count;
+        sys->resize.side = sys->box_side_length;
+        sys->resize.cutoff = sys->cutoff;
+        sys->resize.volume = sys->volume;
+        sys->resize.moments = sys->moments;
+        double new_volume = exp(log(sys->volume) +
+                                random_range(sys, -sys->volume_step,
+                                             sys->volume_step)),
+               s = cbrt(new_volume / sys->volume),
+               s3 = s * s * s,
+               s6 = s3 * s3;
+        sys->delta_pe = 0;
+        if(!Potential::interacts)
+        {
+            scale_box(sys, sys->box_side_length * s, sys->cutoff * s);
+            return;
+        }
+        double old_lj = moments_energy(sys),
+               old_tail = tail_energy(sys, pool),
+               dipoles = sys->current_pe - old_lj - old_tail;
+        scale_box(sys, sys->box_side_length * s, sys->cutoff * s);
+        sys->moments.twelfth /= s6 * s6;
+        sys->moments.sixth /= s6;
+        sys->delta_pe = moments_energy(sys) - old_lj +
+                        tail_energy(sys, pool) - old_tail;
+        if(Potential::dipoles)
+        {
+            sys->delta_pe += dipoles / s3 - dipoles;
+        }
+}
+
+//adds the change an accepted translation made to the box's moments
+static void moved_moments(GCMC_System *sys)
+{
+        particle_store * store = &sys->particles;
+        int pick = sys->move.pick;
+        fixed_coord now[3] = {store->pos[0][pick], store->pos[1][pick],
+                              store->pos[2][pick]},
+                    before[3] = {now[0] - sys->move.phi,
+                                 now[1] - sys->move.gamma,
+                                 now[2] - sys->move.delta};
+        lj_moments gained = {0, 0, 0},
+                   lost = {0, 0, 0};
+        point_moments(sys, now, pick, &sys->lists[0], &gained);
+        point_moments(sys, before, pick, &sys->lists[0], &lost);
+        sys->moments.twelfth += gained.twelfth - lost.twelfth;
+        sys->moments.sixth += gained.sixth - lost.sixth;
+        sys->moments.pairs += gained.pairs - lost.pairs;
+}
+
+//N in the high half and the energy bin in the low half, offset by 2^31 so
+//the keys sort by N and then by energy
+static uint64_t histogram_key(int n, int64_t bin)
+{
+        return ((uint64_t)n << 32) | ((uint32_t)(int32_t)bin ^ 0x80000000u);
+}
+
+//counts the current configuration in the (N, E) histogram
+void histogram_add(GCMC_System *sys)
+{
+        int64_t bin = (int64_t)floor(sys->current_pe / sys->histogram.bin_width);
+        sys->histogram.counts[histogram_key(sys->particles.count, bin)]++;
+}
+
+/*******************************************************************************
+ * write_histogram writes the (N, E) histogram to out, sorted by N and then E,
+ * one "N E count" line per filled bin with E at the middle of its bin. The
+ * header holds the temperature, pressure, volume and bin width the reweight
+ * tool needs to combine it with other runs.
+ * ****************************************************************************/
+void write_histogram(GCMC_System *sys, FILE *out)
+{
+        std::vector< std::pair<uint64_t, double> > filled(
+            sys->histogram.counts.begin(), sys->histogram.counts.end());
+        std::sort(filled.begin(), filled.end());
+        fprintf(out, "# T %.10lf\n# P %.10g\n# V %.10lf\n# bin %.10g\n"
+                     "# N\tE(K)\tcount\n", sys->system_temp, sys->pressure,
+                sys->volume, sys->histogram.bin_width);
+        for(const std::pair<uint64_t, double> & entry : filled)
+        {
+            int n = entry.first >> 32;
+            int32_t bin = (int32_t)((uint32_t)entry.first ^ 0x80000000u);
+            fprintf(out, "%d\t%.10lf\t%.0lf\n", n,
+                    (bin + 0.5) * sys->histogram.bin_width, entry.second);
+        }
+}
+
+//bookkeeping at the end of every step, whatever kind of step it was
+template<class Potential>
+static void finish_step(GCMC_System *sys)
+{
+        output(sys, sys->current_pe);
+        if(!sys->converge_flag && sys->step == sys->production_start)
+        {
+            start_production(sys);
+        }
+        block_add(sys);
+        if(sys->step>=sys->production_start)
+        {
+            sys->production_steps++;
+            sys->sumenergy += sys->current_pe;
+            sys->sumparticles += sys->particles.count;
+            sys->sumvolume += sys->volume;
+            radialDistribution(sys, sys->step);
+            if(sys->histogram.bin_width > 0)
+            {
+                histogram_add(sys);
+            }
+        }
+        if(sys->step % sys->drift_check_interval == 0)
+        {
+            sys->current_pe = check_drift<Potential>(sys, sys->current_pe);
+            if(sys->NPT_flag)
+            {
+                sys->moments = total_moments(sys);
+            }
+        }
+        if(sys->reorder_interval > 0 && sys->step % sys->reorder_interval == 0)
+        {
+            reorder_particles(sys);
+        }
+        if(sys->tmmc.max_particles > 0)
+        {
+            sys->tmmc.visits[sys->particles.count]++;
+            if(sys->step % TMMC_UPDATE_INTERVAL == 0)
+            {
+                tmmc_update_bias(sys);
+            }
+        }
+}
+
+/*******************************************************************************
+ * mc_step makes one trial move, accepts or undoes it, and does the bookkeeping
+ * for that step. sys->current_pe follows the accepted configuration.
+ * ****************************************************************************/
+template<class Potential, class Ensemble>
+void mc_step(GCMC_System *sys)
+{
+        arena_reset(&sys->scratch);//last step's buffers are done with
+        if(!Ensemble::exchanges && sys->particles.count == 0)
+        {
+            finish_step<Potential>(sys);//an empty Gibbs box has nothing to move
+            return;
+        }
+        sys->uniform = random_range(sys, 0,1);//first, so sums can stop early
+        MoveType move_type = make_move<Potential, Ensemble>(sys);
+        //only the moved particle's interactions changed
+        double new_pe = sys->current_pe + sys->delta_pe;
+        bool accepted = move_accepted(sys->current_pe, new_pe, move_type, sys);
+        if(accepted)
+        {
+            sys->current_pe = new_pe;//updates energy
+            if(Ensemble::scales && move_type == TRANSLATE)
+            {
+                moved_moments(sys);
+            }
+        }
+        else // Move rejected
+        {
+            undo_move<Potential>(sys, move_type);
+        }
+        if(sys->tuning.tuning)
+        {
+            tune_record(sys, move_type, accepted);
+        }
+        finish_step<Potential>(sys);
+}
+
+/*******************************************************************************
+ * point_energy is the energy a particle with the given dipole would have at p,
+ * leaving out the particle in slot skip (-1 for none). It only reads the store,
+ * so unlike particle_energy it is safe to call from a worker thread. Like
+ * particle_energy, it may stop at HUGE_VAL once it is sure to be over limit.
+ * ****************************************************************************/
+template<class Potential>
+static double point_energy(GCMC_System *sys, const fixed_coord p[3],
+                           const double dipole[3], int skip, double limit,
+                           pair_lists *lists)
+{
+        if(!Potential::interacts)
+        {
+            return 0;
+        }
+        if(Potential::dipoles)
+        {
+            limit = HUGE_VAL;//dipole pairs have no floor
+        }
+        particle_store * store = &sys->particles;
+        double pe;
+        if(sys->cells.cells_per_side == 0)
+        {
+            //everybody is a neighbour
+            pe = all_but_one(sys, p, skip, limit);
+            if(Potential::dipoles)
+            {
+                lists->neighbors.clear();
+                for(int b = 0;b<store->count;b++)
+                {
+                    if(b != skip)
+                    {
+                        lists->neighbors.push_back(b);
+                    }
+                }
+            }
+        }
+        else if(limit != HUGE_VAL)
+        {
+            pe = bounded_cells(sys, cell_at(sys, p), skip, p, limit, lists);
+        }
+        else
+        {
+            gather_cell(sys, cell_at(sys, p), skip, lists);
+            int n = lists->neighbors.size();
+            for(int i = 0;i<3;i++)
+            {
+                lists->gathered[i].resize(n);
+                for(int j = 0;j<n;j++)
+                {
+                    lists->gathered[i][j] = store->pos[i][lists->neighbors[j]];
+                }
+            }
+            pe = sys->kernel(lists->gathered[0].data(),
+                             lists->gathered[1].data(),
+                             lists->gathered[2].data(), n, p, &sys->lj);
+        }
+        if(Potential::dipoles)
+        {
+            for(int b : lists->neighbors)
+            {
+                double deltas[3];
+                for(int i = 0;i<3;i++)
+                {
+                    deltas[i] = (int32_t)(p[i] - store->pos[i][b]) *
+                                sys->lj.scale;
+                }
+                pe += dipole_pair(sys, deltas, dipole, b);
+            }
+        }
+        return pe;
+}
+
+/*******************************************************************************
+ * Speculative moves. Most trial moves in a dense fluid are rejected, and a
+ * rejected move leaves the state exactly as it was, so the next few moves can
+ * all be drawn and evaluated against the current state at once. speculative_step
+ * draws sys->speculative_moves of them up front (the same way make_move would,
+ * acceptance number included), has the thread pool work out their energy
+ * changes together, then walks them in order: rejected ones are steps where
+ * nothing happened, and the first accepted one is made for real. Everything
+ * drawn after it was proposed from a state that no longer exists, so it is
+ * thrown away. Each move that counts is proposed from and judged against the
+ * state it would have seen in the serial chain, so the chain samples the same
+ * distribution, just with a different stream of random numbers.
+ *
+ * A batch never runs past a step that reorders the store, since that would
+ * shuffle the slots the later moves picked, or past a progress report.
+ * ****************************************************************************/
+typedef struct _speculation
+{
+        GCMC_System * sys;
+        speculative_trial * trials;
+} speculation;
+
+template<class Potential>
+static void speculative_task(void *context, int task, int worker)
+{
+        speculation * batch = (speculation*)context;
+        GCMC_System * sys = batch->sys;
+        particle_store * store = &sys->particles;
+        pair_lists * lists = &sys->lists[worker];
+        speculative_trial * trial = &batch->trials[task];
+        int pool = store->count;
+        trial->delta_pe = 0;
+        if(!Potential::interacts)
+        {
+            return;
+        }
+        if(trial->type == CREATE_PARTICLE)
+        {
+            double tail = tail_energy(sys, pool + 1) - tail_energy(sys, pool),
+                   limit = rejection_limit(sys, acceptance_ratio(sys, 0,
+                                                     CREATE_PARTICLE, pool + 1),
+                                           trial->uniform) - tail;
+            trial->delta_pe = point_energy<Potential>(sys, trial->to,
+                                                      trial->dipole, -1, limit,
+                                                      lists) + tail;
+            return;
+        }
+        int pick = trial->pick;
+        fixed_coord at[3] = {store->pos[0][pick], store->pos[1][pick],
+                             store->pos[2][pick]};
+        double dipole[3] = {store->dipole[0][pick], store->dipole[1][pick],
+                            store->dipole[2][pick]},
+               old_pe = point_energy<Potential>(sys, at, dipole, pick,
+                                                HUGE_VAL, lists);
+        if(trial->type == DESTROY_PARTICLE)
+        {
+            trial->delta_pe = -old_pe + tail_energy(sys, pool - 1) -
+                              tail_energy(sys, pool);
+            return;
+        }
+        trial->delta_pe = point_energy<Potential>(sys, trial->to, trial->dipole,
+                                                  pick, old_pe +
+                                                  rejection_limit(sys, 1.0,
+                                                      trial->uniform),
+                                                  lists) - old_pe;
+}
+
+//draws one trial move from the current state, in the order mc_step and
+//make_move would
+template<class Potential, class Ensemble>
+static void draw_trial(GCMC_System *sys, speculative_trial *trial)
+{
+        particle_store * store = &sys->particles;
+        int pool = store->count;
+        trial->uniform = random_range(sys, 0,1);
+        trial->type = TRANSLATE;
+        trial->pick = -1;
+        if(!Ensemble::exchanges)
+        {
+            trial->pick = random_index(sys, pool);
+        }
+        else if(pool == 0)
+        {
+            trial->type = CREATE_PARTICLE;
+        }
+        else
+        {
+            trial->pick = random_index(sys, pool);
+            double choice = random_range(sys, 0,1),
+                   exchange = sys->tuning.exchange_fraction;
+            //creates and destroys always equally likely
+            if (choice<0.5*exchange)
+            {
+                trial->type = CREATE_PARTICLE;
+            }
+            else if (choice < exchange)
+            {
+                trial->type = DESTROY_PARTICLE;
+            }
+        }
+        if(trial->type == CREATE_PARTICLE)
+        {
+            for(int i = 0;i<3;i++)
+            {
+                trial->to[i] = to_fixed(store,
+                                        random_range(sys, 0,sys->box_side_length));
+                trial->dipole[i] = 0;
+            }
+            if(Potential::dipoles)
+            {
+                pick_dipole_direction(sys, trial->dipole);
+            }
+        }
+        else if(trial->type == TRANSLATE)
+        {
+            double reach = displacement_reach(sys);//half the box untuned
+            for(int i = 0;i<3;i++)
+            {
+                trial->to[i] = store->pos[i][trial->pick] +
+                               to_fixed(store, random_range(sys, -reach, reach));
+                trial->dipole[i] = store->dipole[i][trial->pick];
+            }
+            if(Potential::dipoles)
+            {
+                if(sys->tuning.max_rotation < M_PI)
+                {
+                    turn_dipole(sys, trial->dipole, sys->tuning.max_rotation);
+                }
+                else
+                {
+                    pick_dipole_direction(sys, trial->dipole);
                 }
             }
         }
-	return;
+}
+
+//makes an accepted trial move for real
+static void apply_trial(GCMC_System *sys, const speculative_trial *trial)
+{
+        particle_store * store = &sys->particles;
+        int pick = trial->pick;
+        if(trial->type == TRANSLATE)
+        {
+            for(int i = 0;i<3;i++)
+            {
+                store->pos[i][pick] = trial->to[i];
+                store->dipole[i][pick] = trial->dipole[i];
+            }
+            cell_update(sys, pick);
+        }
+        else if(trial->type == CREATE_PARTICLE)
+        {
+            particle added = {};
+            added.id = -1;
+            for(int i = 0;i<3;i++)
+            {
+                added.x[i] = to_angstroms(store, trial->to[i]);
+                added.dipole[i] = trial->dipole[i];
+            }
+            cell_insert(sys, store_insert(store, &added));
+        }
+        else
+        {
+            cell_remove(sys, pick);
+            int moved = store_remove(store, pick);
+            if(moved != pick)
+            {
+                cell_relabel(sys, moved, pick);
+            }
+        }
+}
+
+//how many moves the batch starting at sys->step can hold
+static int speculation_size(GCMC_System *sys)
+{
+        int size = 1;
+        while(size < sys->speculative_moves &&
+              sys->step + size < sys->maxStep)
+        {
+            int last = sys->step + size - 1,
+                next = sys->step + size;
+            if((sys->reorder_interval > 0 && last % sys->reorder_interval == 0) ||
+               next % (sys->maxStep/10) == 0)
+            {
+                break;
+            }
+            size++;
+        }
+        return size;
+}
+
+//one batch of speculative moves; leaves sys->step on the last step it used
+template<class Potential, class Ensemble>
+void speculative_step(GCMC_System *sys)
+{
+        arena_reset(&sys->scratch);
+        if(!Ensemble::exchanges && sys->particles.count == 0)
+        {
+            finish_step<Potential>(sys);//an empty fixed-N box has nothing to move
+            return;
+        }
+        int size = speculation_size(sys);
+        speculation batch = {sys, (speculative_trial*)arena_alloc(&sys->scratch,
+                                      size * sizeof(speculative_trial))};
+        for(int t = 0;t<size;t++)
+        {
+            draw_trial<Potential, Ensemble>(sys, &batch.trials[t]);
+        }
+        if(sys->pool == NULL || size < 2)
+        {
+            for(int t = 0;t<size;t++)
+            {
+                speculative_task<Potential>(&batch, t, 0);
+            }
+        }
+        else
+        {
+            pool_run(sys->pool, size, speculative_task<Potential>, &batch);
+        }
+        int pool = sys->particles.count;
+        for(int t = 0;t<size;t++)
+        {
+            speculative_trial * trial = &batch.trials[t];
+            int after = pool + (trial->type == CREATE_PARTICLE) -
+                        (trial->type == DESTROY_PARTICLE);
+            bool accepted = acceptance_ratio(sys, trial->delta_pe, trial->type,
+                                             after) > trial->uniform;
+            if(t > 0)
+            {
+                sys->step++;
+            }
+            if(accepted)
+            {
+                apply_trial(sys, trial);
+                sys->current_pe += trial->delta_pe;
+            }
+            finish_step<Potential>(sys);
+            if(accepted || sys->stopped)
+            {
+                break;
+            }
+        }
+}
+
+/*******************************************************************************
+ * Checkerboard sweeps. The cells are at least a cutoff wide and there is an
+ * even number of them per side, so colouring each one by the parity of its
+ * three indices gives eight colours where no two cells of the same colour
+ * touch. A particle in one cell only ever sees its own cell and the 26 around
+ * it, none of which share its colour, so every cell of one colour can make a
+ * trial move at the same time without any of them seeing the others.
+ *
+ * Each cell gets exactly one move per phase, chosen like make_move does:
+ *   translation: a displacement of up to half a cell each way; leaving the
+ *                cell counts as a rejection, which keeps the proposal
+ *                symmetric and the cell list untouched
+ *   insertion:   at a random point in the cell, accepted with
+ *                V_c P / (kT (N_c + 1)) exp(-beta dU)
+ *   deletion:    of one of the cell's N_c particles, accepted with
+ *                kT N_c / (V_c P) exp(-beta dU)
+ * which is the usual grand canonical acceptance with the cell's volume and
+ * particle count in place of the box's, so each move keeps detailed balance.
+ * Insertions and deletions can't touch the store while other threads are
+ * reading it, so they are kept and applied once the phase is over; with one
+ * move per cell nothing in the phase needs to see them first. Every sweep
+ * shifts the grid by a random offset and visits the colours in a random order
+ * so no cell boundary or colour stays special.
+ *
+ * Cells draw from their own split_rng streams, so a sweep does the same thing
+ * on any number of threads.
+ * ****************************************************************************/
+#define CELLS_PER_TASK 8
+
+typedef struct _checkerboard_phase
+{
+        GCMC_System * sys;
+        int colour,//bit i is the parity of the cells' ith index
+            cells;//how many cells have this colour
+        uint64_t seed;
+        cell_move * moves;//one per cell of this colour
+} checkerboard_phase;
+
+//uniformly random direction with the dipole magnitude, from a cell's stream
+static void rng_dipole(GCMC_System *sys, split_rng *rng, double dipole[3])
+{
+        double theta = 2 * M_PI * rng_uniform(rng),
+               z = 2 * rng_uniform(rng) - 1,
+               xy = sqrt(1 - z*z);
+        dipole[0] = xy * cos(theta) * sys->dipole_magnitude;
+        dipole[1] = xy * sin(theta) * sys->dipole_magnitude;
+        dipole[2] = z * sys->dipole_magnitude;
+}
+
+//the single trial move of cell number j of this phase's colour
+template<class Potential, class Ensemble>
+static void cell_trial(checkerboard_phase *phase, int j, pair_lists *lists)
+{
+        GCMC_System * sys = phase->sys;
+        particle_store * store = &sys->particles;
+        cell_list * cells = &sys->cells;
+        cell_move * result = &phase->moves[j];
+        result->delta_pe = 0;
+        result->removed = -1;
+        result->inserted = false;
+        split_rng rng;
+        rng_seed(&rng, phase->seed, j);
+        int n = cells->cells_per_side,
+            half = n / 2,
+            c[3] = {2 * (j / (half * half)) + (phase->colour & 1),
+                    2 * ((j / half) % half) + ((phase->colour >> 1) & 1),
+                    2 * (j % half) + ((phase->colour >> 2) & 1)},
+            home = (c[0] * n + c[1]) * n + c[2];
+        const std::vector<int> & members = cells->members[home];
+        int in_cell = members.size();
+        double beta = 1.0 / (k * sys->system_temp),
+               cell_volume = sys->volume / (double)(n * n * n),
+               cell_width = FIXED_PER_BOX / n,
+               choice = Ensemble::exchanges ? rng_uniform(&rng) : 1.0;
+        if(choice < 0.33333)
+        {
+            fixed_coord p[3];
+            for(int i = 0;i<3;i++)
+            {
+                p[i] = (fixed_coord)(int64_t)((c[i] + rng_uniform(&rng)) *
+                                              cell_width) - cells->offset[i];
+                fixed_coord shifted = p[i] + cells->offset[i];
+                if((int)(((uint64_t)shifted * n) >> 32) != c[i])
+                {
+                    return;//rounded onto the next cell over
+                }
+            }
+            double dipole[3] = {0, 0, 0};
+            if(Potential::dipoles)
+            {
+                rng_dipole(sys, &rng, dipole);
+            }
+            double prefactor = cell_volume * sys->pressure * conv_factor /
+                               (sys->system_temp * (in_cell + 1)),
+                   uniform = rng_uniform(&rng),
+                   delta = point_energy<Potential>(sys, p, dipole, -1,
+                               rejection_limit(sys, prefactor, uniform), lists);
+            if(exp(-beta * delta) * prefactor > uniform)
+            {
+                result->delta_pe = delta;
+                result->inserted = true;
+                for(int i = 0;i<3;i++)
+                {
+                    result->added.x[i] = to_angstroms(store, p[i]);
+                    result->added.dipole[i] = dipole[i];
+                }
+                result->added.id = -1;
+            }
+        }
+        else if(choice < 0.666667)
+        {
+            if(in_cell == 0)
+            {
+                return;
+            }
+            int pick = members[(int)(rng_uniform(&rng) * in_cell)];
+            double delta = -particle_energy<Potential>(sys, pick, HUGE_VAL,
+                                                       lists),
+                   acceptance = exp(-beta * delta) * sys->system_temp *
+                                in_cell / (cell_volume * sys->pressure *
+                                           conv_factor);
+            if(acceptance > rng_uniform(&rng))
+            {
+                result->delta_pe = delta;
+                result->removed = store->id[pick];
+            }
+        }
+        else
+        {
+            if(in_cell == 0)
+            {
+                return;
+            }
+            int pick = members[(int)(rng_uniform(&rng) * in_cell)];
+            double old_pe = particle_energy<Potential>(sys, pick, HUGE_VAL,
+                                                       lists);
+            fixed_coord old_pos[3];
+            real old_dipole[3];
+            for(int i = 0;i<3;i++)
+            {
+                old_pos[i] = store->pos[i][pick];
+                old_dipole[i] = store->dipole[i][pick];
+                store->pos[i][pick] += (fixed_coord)(int32_t)
+                                       ((rng_uniform(&rng) - 0.5) * cell_width);
+            }
+            bool accepted = false;
+            if(cell_index(sys, pick) == home)
+            {
+                if(Potential::dipoles)
+                {
+                    double dipole[3];
+                    rng_dipole(sys, &rng, dipole);
+                    for(int i = 0;i<3;i++)
+                    {
+                        store->dipole[i][pick] = dipole[i];
+                    }
+                }
+                double uniform = rng_uniform(&rng),
+                       delta = particle_energy<Potential>(sys, pick,
+                                   old_pe + rejection_limit(sys, 1.0, uniform),
+                                   lists) - old_pe;
+                if(exp(-beta * delta) > uniform)
+                {
+                    result->delta_pe = delta;
+                    accepted = true;
+                }
+            }
+            if(!accepted)
+            {
+                for(int i = 0;i<3;i++)
+                {
+                    store->pos[i][pick] = old_pos[i];
+                    store->dipole[i][pick] = old_dipole[i];
+                }
+            }
+        }
+}
+
+template<class Potential, class Ensemble>
+static void checkerboard_task(void *context, int task, int worker)
+{
+        checkerboard_phase * phase = (checkerboard_phase*)context;
+        int end = (task + 1) * CELLS_PER_TASK;
+        if(end > phase->cells)
+        {
+            end = phase->cells;
+        }
+        for(int j = task * CELLS_PER_TASK;j<end;j++)
+        {
+            cell_trial<Potential, Ensemble>(phase, j,
+                                            &phase->sys->lists[worker]);
+        }
+}
+
+//adds up the phase's energy change and makes its insertions and deletions
+static void apply_phase(GCMC_System *sys, checkerboard_phase *phase)
+{
+        particle_store * store = &sys->particles;
+        for(int j = 0;j<phase->cells;j++)
+        {
+            cell_move * result = &phase->moves[j];
+            sys->current_pe += result->delta_pe;
+            if(result->removed >= 0)
+            {
+                int pick = store->slot[result->removed];
+                cell_remove(sys, pick);
+                int moved = store_remove(store, pick);
+                if(moved != pick)
+                {
+                    cell_relabel(sys, moved, pick);
+                }
+            }
+        }
+        for(int j = 0;j<phase->cells;j++)
+        {
+            if(phase->moves[j].inserted)
+            {
+                cell_insert(sys, store_insert(store, &phase->moves[j].added));
+            }
+        }
+}
+
+//one sweep: a trial move in every cell, colour by colour
+template<class Potential, class Ensemble>
+void checkerboard_step(GCMC_System *sys)
+{
+        arena_reset(&sys->scratch);
+        fixed_coord offset[3];
+        for(int i = 0;i<3;i++)
+        {
+            offset[i] = (fixed_coord)(int64_t)(random_range(sys, 0,1) * FIXED_PER_BOX);
+        }
+        shift_cells(sys, offset);
+        int colours[8];
+        for(int c = 0;c<8;c++)
+        {
+            colours[c] = c;
+        }
+        for(int c = 7;c>0;c--)
+        {
+            std::swap(colours[c], colours[random_index(sys, c + 1)]);
+        }
+        int half = sys->cells.cells_per_side / 2;
+        checkerboard_phase phase;
+        phase.sys = sys;
+        phase.cells = half * half * half;
+        phase.moves = (cell_move*)arena_alloc(&sys->scratch,
+                                              phase.cells * sizeof(cell_move));
+        int tasks = (phase.cells + CELLS_PER_TASK - 1) / CELLS_PER_TASK;
+        for(int c = 0;c<8;c++)
+        {
+            phase.colour = colours[c];
+            phase.seed = (uint64_t)(rng_uniform(&sys->rng) * 9007199254740992.0);
+            if(sys->pool == NULL || tasks < 2)
+            {
+                for(int t = 0;t<tasks;t++)
+                {
+                    checkerboard_task<Potential, Ensemble>(&phase, t, 0);
+                }
+            }
+            else
+            {
+                pool_run(sys->pool, tasks, checkerboard_task<Potential, Ensemble>,
+                         &phase);
+            }
+            apply_phase(sys, &phase);
+        }
+        finish_step<Potential>(sys);
+}
+
+/*******************************************************************************
+ * resize_box changes the box to side, moving every particle with it. The
+ * coordinates are fractions of the box, so that is just a new scale, plus a
+ * new cell list since the cells are a cutoff wide. The cutoff itself stays
+ * put, so the box must stay at least twice as wide as it.
+ * ****************************************************************************/
+void resize_box(GCMC_System *sys, double side)
+{
+        sys->box_side_length = side;
+        sys->half_box = side * .5;
+        sys->volume = side * side * side;
+        sys->particles.box_side_length = side;
+        set_lj_params(sys);
+        build_cells(sys);
+}
+
+/*******************************************************************************
+ * Gibbs ensemble moves between two boxes a and b at the same temperature, with
+ * the total number of particles and the total volume fixed (Panagiotopoulos;
+ * Frenkel and Smit ch. 8). Each box runs its own translations as an NVT
+ * system; these are the moves that couple them.
+ *
+ * transfer_particle takes a random particle out of from and puts it at a random
+ * spot in to, keeping its dipole, accepted with
+ *   N_from V_to / ((N_to + 1) V_from) exp(-beta (dU_from + dU_to))
+ * ****************************************************************************/
+template<class Potential>
+static bool transfer_particle(GCMC_System *from, GCMC_System *to)
+{
+        int n_from = from->particles.count,
+            n_to = to->particles.count;
+        if(n_from == 0)
+        {
+            return false;
+        }
+        int pick = random_index(from, n_from);
+        particle moved;
+        store_get(&from->particles, pick, &moved);
+        moved.id = -1;
+        for(int i = 0;i<3;i++)
+        {
+            moved.x[i] = random_range(from, 0,to->box_side_length);
+        }
+        double delta_from = 0,
+               delta_to = 0,
+               prefactor = n_from * to->volume / ((n_to + 1) * from->volume),
+               uniform = random_range(from, 0,1);
+        int added = store_insert(&to->particles, &moved);
+        cell_insert(to, added);
+        if(Potential::interacts)
+        {
+            delta_from = -particle_energy<Potential>(from, pick, HUGE_VAL,
+                                                     &from->lists[0]) +
+                         tail_energy(from, n_from - 1) - tail_energy(from, n_from);
+            //the insertion is where the overlaps are, so it can stop early
+            double tail = tail_energy(to, n_to + 1) - tail_energy(to, n_to);
+            delta_to = particle_energy<Potential>(to, added,
+                           rejection_limit(from, prefactor, uniform) -
+                           delta_from - tail, &to->lists[0]) + tail;
+        }
+        double beta = 1.0 / (k * from->system_temp),
+               ratio = prefactor * exp(-beta * (delta_from + delta_to));
+        if(ratio <= uniform)
+        {
+            undo_insertion(to);
+            return false;
+        }
+        cell_remove(from, pick);
+        int last = store_remove(&from->particles, pick);
+        if(last != pick)
+        {
+            cell_relabel(from, last, pick);
+        }
+        from->current_pe += delta_from;
+        to->current_pe += delta_to;
+        return true;
+}
+
+/*******************************************************************************
+ * exchange_volume takes a random walk in ln(V_a/V_b), of up to max_step either
+ * way, keeping V_a + V_b fixed, so V_a' = total e^x / (1 + e^x) for the new
+ * ratio x. Walking in ln(V_a/V_b) treats the two boxes alike and makes the
+ * acceptance (Frenkel and Smit, section 8.3)
+ *   exp(-beta (dU_a + dU_b) + (N_a + 1) ln(V_a'/V_a) + (N_b + 1) ln(V_b'/V_b))
+ * Neither box may end up narrower than twice the cutoff.
+ * ****************************************************************************/
+template<class Potential>
+static bool exchange_volume(GCMC_System *a, GCMC_System *b, double max_step)
+{
+        double old_a = a->volume,
+               old_b = b->volume,
+               total = old_a + old_b,
+               ratio = log(old_a / old_b) + random_range(a, -max_step, max_step),
+               new_a = total / (1 + exp(-ratio)),
+               new_b = total - new_a,
+               side_a = cbrt(new_a),
+               side_b = new_b > 0 ? cbrt(new_b) : 0,
+               random = random_range(a, 0,1);
+        if(side_a < 2 * a->cutoff || side_b < 2 * b->cutoff)
+        {
+            return false;
+        }
+        double old_side_a = a->box_side_length,
+               old_side_b = b->box_side_length,
+               old_pe_a = a->current_pe,
+               old_pe_b = b->current_pe;
+        resize_box(a, side_a);
+        resize_box(b, side_b);
+        double pe_a = calculate_PE<Potential>(a),
+               pe_b = calculate_PE<Potential>(b),
+               beta = 1.0 / (k * a->system_temp),
+               log_ratio = -beta * (pe_a - old_pe_a + pe_b - old_pe_b) +
+                           (a->particles.count + 1) * log(new_a / old_a) +
+                           (b->particles.count + 1) * log(new_b / old_b);
+        if(exp(log_ratio) <= random)
+        {
+            resize_box(a, old_side_a);
+            resize_box(b, old_side_b);
+            return false;
+        }
+        a->current_pe = pe_a;
+        b->current_pe = pe_b;
+        return true;
+}
+
+//the Gibbs moves for whichever potential the flags ask for
+bool gibbs_transfer(GCMC_System *from, GCMC_System *to)
+{
+        if(from->ideal_flag)
+        {
+            return transfer_particle<Ideal>(from, to);
+        }
+        else if(from->stockmayer_flag)
+        {
+            return transfer_particle<Stockmayer>(from, to);
+        }
+        return transfer_particle<LJ>(from, to);
+}
+
+bool gibbs_volume(GCMC_System *a, GCMC_System *b, double max_step)
+{
+        if(a->ideal_flag)
+        {
+            return exchange_volume<Ideal>(a, b, max_step);
+        }
+        else if(a->stockmayer_flag)
+        {
+            return exchange_volume<Stockmayer>(a, b, max_step);
+        }
+        return exchange_volume<LJ>(a, b, max_step);
+}
+
+//the run from where it is up to (not including) step until, starting with
+//the first energy if it hasn't started yet
+template<class Potential, class Ensemble>
+void simulate(GCMC_System *sys, int until)
+{
+        if(sys->step == 0)
+        {
+            sys->current_pe = calculate_PE<Potential>(sys);//energy at first step
+            if(sys->energy_output_flag)
+            {
+                fprintf(sys->energies, "0 %lf\n", sys->current_pe);
+            }
+            //only the production phase counts
+            sys->sumenergy = 0;
+            sys->sumparticles = 0;
+            //-converge decides where production starts as it goes
+            sys->production_start = sys->converge_flag ? INT_MAX
+                                                       : (sys->maxStep + 1) / 2;
+            if(Ensemble::scales)
+            {
+                sys->moments = total_moments(sys);
+            }
+            sys->step = 1;
+        }
+        for(; sys->step<until && !sys->stopped; sys->step++)
+        {
+            if(!sys->quiet_flag && sys->step % (sys->maxStep/10) == 0)
+            {
+                double cycles_till_now = (double)(clock()-sys->start_time),
+                       time_till_now = cycles_till_now/CLOCKS_PER_SEC;
+                printf("  %.0f%% of iteration steps done. Time elapsed:"\
+                        " %.2lf seconds.\n",\
+                        ((double)sys->step/(double)sys->maxStep)*100,
+                        time_till_now);
+                if(sys->checkpoint_file != NULL)
+                {
+                    write_checkpoint(sys, sys->checkpoint_file);
+                }
+            }
+            if(sys->checkerboard_flag)
+            {
+                checkerboard_step<Potential, Ensemble>(sys);
+            }
+            else if(sys->speculative_moves > 1)
+            {
+                speculative_step<Potential, Ensemble>(sys);
+            }
+            else
+            {
+                mc_step<Potential, Ensemble>(sys);
+            }
+        }
+        if(sys->step >= sys->maxStep || sys->stopped)
+        {
+            if(sys->production_steps > 0)//else -converge never settled
+            {
+                write_radial(sys);
+            }
+            if(sys->checkpoint_file != NULL)
+            {
+                write_checkpoint(sys, sys->checkpoint_file);
+            }
+        }
+}
+
+template<class Potential>
+static void simulate_in_ensemble(GCMC_System *sys, int until)
+{
+        if(sys->NPT_flag)
+        {
+            simulate<Potential, NPT>(sys, until);
+        }
+        else if(sys->NVT_flag)
+        {
+            simulate<Potential, NVT>(sys, until);
+        }
+        else
+        {
+            simulate<Potential, MuVT>(sys, until);
+        }
+}
+
+//the only place the potential and ensemble flags are looked at during a run;
+//runs up to step until, so a run can be done in pieces
+void run_simulation(GCMC_System *sys, int until)
+{
+        if(sys->ideal_flag)
+        {
+            simulate_in_ensemble<Ideal>(sys, until);
+        }
+        else if(sys->stockmayer_flag)
+        {
+            simulate_in_ensemble<Stockmayer>(sys, until);
+        }
+        else
+        {
+            simulate_in_ensemble<LJ>(sys, until);
+        }
 }
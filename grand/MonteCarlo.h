@@ -1,43 +1,338 @@
 #include <vector>
+#include <algorithm>
 #include <math.h>
 #include <stdio.h>
 #include <random>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
 
 #ifndef MONTE_CARLO_H
 #define MONTE_CARLO_H
 
+/*******************************************************************************
+ * Compile with -DSINGLE_PRECISION to store dipoles and compute pair terms in
+ * float, which doubles the pairs per vector register. Energies and averages
+ * are always accumulated in double either way.
+ * ****************************************************************************/
+#ifdef SINGLE_PRECISION
+typedef float real;
+#define PRECISION_NAME "single"
+#define KERNEL_TOLERANCE 1e-4
+#define DRIFT_TOLERANCE 1e-4
+#else
+typedef double real;
+#define PRECISION_NAME "double"
+#define KERNEL_TOLERANCE 1e-9
+#define DRIFT_TOLERANCE 1e-6
+#endif
+
+/*******************************************************************************
+ * Coordinates are stored as unsigned 32 bit fractions of the box side, so a
+ * particle can never leave the box: moving past the wall just overflows back
+ * around. The minimum image difference between two particles is their
+ * difference cast to a signed int, with no branches at all.
+ * ****************************************************************************/
+typedef uint32_t fixed_coord;
+#define FIXED_PER_BOX 4294967296.0 //2^32, one whole box side
+
+//one particle's worth of data, for moving particles in and out of the store;
+//x is in angstroms here and only becomes fixed point inside the store
 typedef struct particle_particle
 {
 	double x[3],
-               dipole_magnitude,
                dipole[3];
+        int id;//stable id, -1 asks store_insert for a new one
 } particle;
 
+/*******************************************************************************
+ * particle_store keeps each coordinate and dipole component in its own
+ * contiguous, cache-line aligned array, so the pair loops only stream the
+ * coordinates they need. Capacity is always a multiple of STORE_PADDING so
+ * vector loops can safely run past count to the end of a block.
+ *
+ * Removal swaps the last particle into the hole, so slots move around. Every
+ * particle also carries a stable id that stays with it for its whole life and
+ * is what gets written to trajectories; ids of removed particles are reused.
+ * ****************************************************************************/
+#define STORE_ALIGNMENT 64
+#define STORE_PADDING 8
+typedef struct _particle_store
+{
+        int count,
+            capacity;
+        double box_side_length;//to convert coordinates to and from angstroms
+        fixed_coord * pos[3];
+        real * dipole[3];
+        int * id,//stable id of the particle in each slot
+            * slot,//slot of each stable id
+            * free_ids,//stack of ids that can be handed out again
+            free_count,
+            next_id;//lowest id never handed out
+} particle_store;
+
+/*******************************************************************************
+ * scratch_arena hands out temporary buffers by bumping a pointer through one
+ * block, and arena_reset takes them all back at once at the start of every
+ * step, so nothing in the loop calls malloc once the block is big enough. If a
+ * step asks for more than the block holds, a bigger block is started and the
+ * old ones are kept until the reset, which then replaces them all with one
+ * block the size of the most that was ever needed.
+ * ****************************************************************************/
+typedef struct _scratch_arena
+{
+        char * block;
+        size_t used,
+               size,
+               high_water;//bytes handed out from retired blocks since the reset
+        std::vector<char*> retired;//outgrown blocks, freed at the next reset
+} scratch_arena;
+
 typedef struct _translational_data
 {
 	int pick;
-	double phi, gamma, delta;
+	fixed_coord phi, gamma, delta;//displacement, undone by subtracting it
         double dipole[3];
 } translational_data;
 
 typedef struct _removal_data
 {
-	double phi, gamma, delta;
+	int pick;
+        particle removed;//the whole particle, so undo puts it back exactly
 } removal_data;
 
 
+//linked cells a little wider than the cutoff, so a particle only ever
+//interacts with particles in its own cell and the 26 around it
+typedef struct _cell_list
+{
+        int cells_per_side;//less than 3 means the cell list is off
+        std::vector< std::vector<int> > members;//particle ids in each cell
+        std::vector<int> cell_of,//which cell each particle is in
+                         slot_of;//where the particle is in that cell
+        fixed_coord offset[3];//where the grid starts, for checkerboard sweeps
+} cell_list;
+
+/*******************************************************************************
+ * A pair potential tabulated on an even grid in r^2 from r2_min out to the
+ * cutoff. Each interval holds the four coefficients of its cubic spline, in
+ * powers of the fraction of the way across it, so a lookup is one index and a
+ * Horner evaluation no matter what the potential is.
+ * ****************************************************************************/
+#define TABLE_INTERVALS 2048
+typedef struct _pair_table
+{
+        double r2_min,
+               inverse_spacing,//intervals per A^2
+               floor;//lowest value the spline takes, never above 0
+        int intervals = 0;//until build_table fills it in
+        std::vector<real> coefficients;//4 per interval
+} pair_table;
+
+//per thread scratch for walking neighbours, so threads never share one
+typedef struct _pair_lists
+{
+        std::vector<int> neighbors;//filled by gather_neighbors
+        std::vector<fixed_coord> gathered[3];//their coordinates, for kernels
+        std::vector<double> bins;//this thread's share of a g(r) histogram
+} pair_lists;
+
+/*******************************************************************************
+ * thread_pool keeps its workers alive for the whole run; pool_run hands them
+ * tasks 0 to count-1 and works on them itself too, returning when all are
+ * done. Which thread gets which task changes from run to run, so a task must
+ * only write to its own slot of the output; reductions then add the slots up
+ * in task order, which makes the answer the same for any number of threads.
+ * ****************************************************************************/
+typedef void (*pool_task)(void *context, int task, int worker);
+
+typedef struct _thread_pool
+{
+        std::vector<std::thread> threads;//worker w is threads[w-1]; 0 is main
+        std::mutex lock;
+        std::condition_variable wake,//workers wait here for the next batch
+                                done;//pool_run waits here for the workers
+        pool_task task;
+        void * context;
+        int task_count,
+            busy;//workers that haven't finished the current batch
+        std::atomic<int> next_task;
+        long batch;//bumped for every pool_run, so workers know it's new
+        bool stopping;
+} thread_pool;
+
+//everything the Lennard-Jones kernels need, packed together
+typedef struct _lj_params
+{
+        const pair_table * table;//only read by table_kernel
+        double scale,//angstroms per fixed point step
+               cutoff_squared,
+               sigma_sixth,
+               four_epsilon,
+               shift,
+               floor;//no one pair inside the cutoff is lower
+} lj_params;
+
+//LJ energy of a particle at p with n particles in contiguous arrays
+typedef double (*lj_kernel)(const fixed_coord *x, const fixed_coord *y,
+                            const fixed_coord *z, int n,
+                            const fixed_coord p[3], const lj_params *lj);
+
+/*******************************************************************************
+ * lj_moments are the Lennard-Jones sums behind an energy, in units of sigma:
+ * the sums of (sigma/r)^12 and (sigma/r)^6 over pairs inside the cutoff, and
+ * how many pairs that is. Scaling every distance by s scales the first by
+ * s^-12 and the second by s^-6 and leaves the count alone (the NPT cutoff
+ * scales too), so they give the energy of a resized box without a pair loop.
+ * ****************************************************************************/
+typedef struct _lj_moments
+{
+        double twelfth,
+               sixth,
+               pairs;
+} lj_moments;
+
+//what an NPT volume move needs to put the box back
+typedef struct _resize_data
+{
+        double side,
+               cutoff,
+               volume;
+        lj_moments moments;
+} resize_data;
+
+/*******************************************************************************
+ * split_rng is a Philox4x32-10 stream. Philox is counter based: block number b
+ * of stream s under seed key is a fixed function of (key, s, b), so every
+ * system, replica, job and checkerboard cell gets a stream of its own that
+ * doesn't depend on which thread runs it or what the others drew. Uniforms are
+ * made RNG_BATCH at a time in a loop over independent blocks, which the
+ * compiler can vectorize, and handed out from batch.
+ * ****************************************************************************/
+#define RNG_BATCH 16
+typedef struct _split_rng
+{
+        uint64_t key,//the seed
+                 stream,
+                 block;//counter of the next block to make
+        double batch[RNG_BATCH];
+        int next;//first number in batch not handed out yet
+} split_rng;
+
+//what one cell's trial move in a checkerboard phase did; exchanges wait here
+//until the phase is over
+typedef struct _cell_move
+{
+        double delta_pe;//energy change if accepted, else 0
+        int removed;//stable id of a deleted particle, or -1
+        bool inserted;
+        particle added;
+} cell_move;
+
+/*******************************************************************************
+ * tmmc_data is the collection matrix of a -tmmc run. For every N from 0 to
+ * max_particles it sums the unbiased acceptance probabilities of the
+ * insertions and deletions tried from N and counts the tries, so the mean
+ * probabilities of going up from N and down from N+1 give
+ * ln Pi(N+1) - ln Pi(N).
+ * ****************************************************************************/
+typedef struct _tmmc_data
+{
+        int max_particles = 0;//0 means TMMC is off
+        std::vector<double> up,//summed insertion probabilities from each N
+                            down,//summed deletion probabilities
+                            up_tries,
+                            down_tries,
+                            bias,//-ln Pi as far as it's known, for the moves
+                            visits;//steps spent at each N
+} tmmc_data;
+
+/*******************************************************************************
+ * energy_histogram counts the production half's configurations by N and by
+ * energy, in bins bin_width kelvin wide. Only the (N, E) pairs that actually
+ * turn up get an entry, so it stays small however wide the energies spread.
+ * The reweight tool combines these from several runs to estimate averages at
+ * state points that weren't run.
+ * ****************************************************************************/
+typedef struct _energy_histogram
+{
+        double bin_width = 0;//0 means no histogram
+        std::unordered_map<uint64_t, double> counts;//by histogram_key
+} energy_histogram;
+
+/*******************************************************************************
+ * block_stats averages the energy and N over blocks of block_steps steps, for
+ * error bars, statistical inefficiencies and, with -converge, deciding when
+ * production starts and when the run has done enough.
+ * ****************************************************************************/
+typedef struct _block_stats
+{
+        int block_steps = 1000,
+            filled = 0,//steps in the open block
+            first_production = 0,//first block of the production phase
+            settled_at = -1;//step the run settled by, with -converge
+        double energy_sum = 0,//of the open block
+               energy_squares = 0,
+               particle_sum = 0,
+               particle_squares = 0;
+        std::vector<double> energy,//mean of each closed block
+                            energy_squared,//mean square of each
+                            particles,
+                            particles_squared;
+        std::vector<int> ends;//last step of each
+        //-converge stops the run once both error bars are this small
+        double energy_target = 0,
+               particle_target = 0;
+} block_stats;
+
+//what -tune adjusts during equilibration, and its counts since it last did
+typedef struct _move_tuning
+{
+        double max_displacement = 0,//in A, 0 means up to half the box
+               max_rotation = M_PI,//largest dipole turn in a translation
+               exchange_fraction = 2.0 / 3,//creates and destroys together
+               attempts[4] = {},//by MoveType
+               accepted[4] = {},
+               decorrelation = 0;//of the accepted translations, see Tuning.cpp
+        int moves = 0;
+        bool tuning = false;//until production starts
+} move_tuning;
+
 typedef struct _GCMC_System
 {
         FILE * output;
         FILE * energies;
         FILE * unweightedradial;
         FILE * weightedradial;
-	std::vector <particle> particles;
+	particle_store particles;
 	translational_data move;
 	removal_data destroy;
+        resize_data resize;
+        lj_moments moments;//of the whole box, kept up to date with -NPT
+        tmmc_data tmmc;
+        energy_histogram histogram;
+        block_stats blocks;
+        move_tuning tuning;
+        cell_list cells;
+        std::vector<pair_lists> lists;//one per thread; lists[0] is main's
+        thread_pool * pool;//NULL when running on one thread
+        lj_params lj;
+        lj_kernel kernel;//picked by select_kernel for this CPU
+        const char * kernel_isa;
+        pair_table table;//used instead of LJ with -table or -tablefile
+        scratch_arena scratch;//temporary buffers, reset every step
+        uint64_t seed;//of every stream in the run, -seed or from the clock
+        split_rng rng;//this system's stream; all its moves draw from it
+        const char * checkpoint_file = NULL;//NULL means no checkpoints
+        const char * restart_file = NULL;//NULL means start from scratch
         //Lennard-Jones parameters
 	double epsilon,
                particle_mass,
@@ -46,17 +341,40 @@ typedef struct _GCMC_System
                dipole_magnitude,
                sigma_squared,//powers of sigma for PE
                sigma_sixth,
-               sigma_twelfth;
+               sigma_twelfth,
+               energy_shift;//LJ at the cutoff, taken off every pair with -shift
         char particle_type[25];
         //system variables
         double system_temp,
-               cutoff;
+               pressure = 1,//in atm: the reservoir's, which sets mu, or NPT's
+               cutoff,//interaction cutoff, at most half the box
+               half_box;//for the minimum image convention
         double box_side_length;
-        int    maxStep,
-               volume;
-        //for averaging
+        int    maxStep;
+        //first step of the production phase and how many steps it has had
+        int production_start,
+            production_steps = 0;
+        double volume;
+        //for averaging over the production phase
         double sumparticles,
-               sumenergy;
+               sumenergy,
+               sumvolume = 0;
+        //largest change in ln V in one NPT volume move
+        double volume_step = 0.01;
+        //the number the current move's acceptance is checked against, drawn
+        //before the move so its energy sum can stop as soon as it must fail
+        double uniform;
+        //energy change of the last trial move, filled in by make_move
+        double delta_pe,
+               current_pe;//energy of the accepted configuration
+        //how often the running energy is checked against a full recompute
+        int drift_check_interval = 10000;
+        //steps between sorting the particles along a space filling curve,
+        //0 for never
+        int reorder_interval = 0;
+        //trial moves drawn and evaluated together with -speculate, 0 for the
+        //usual one at a time
+        int speculative_moves = 0;
         //next three lines are for radial distribution function
         double BinSize = .5; 
         int nBins,
@@ -68,10 +386,71 @@ typedef struct _GCMC_System
              stockmayer_flag,
              output_flag,
              debug_flag,
-             NVT_flag;
+             NVT_flag,
+             shift_flag,
+             tail_flag,
+             checkerboard_flag,
+             NPT_flag = false,
+             converge_flag = false,//find production and stop by error bars
+             stopped = false,//-converge has reached its error bars
+             quiet_flag = false;//no progress reports, for replicas
 } GCMC_System;
 
-enum MoveType { TRANSLATE, CREATE_PARTICLE, DESTROY_PARTICLE };
+enum MoveType { TRANSLATE, CREATE_PARTICLE, DESTROY_PARTICLE, CHANGE_VOLUME };
+
+//one trial move drawn ahead of time by speculative_step, with everything it
+//needs to be evaluated without touching the store
+typedef struct _speculative_trial
+{
+        MoveType type;
+        int pick;//slot of the moved or deleted particle
+        fixed_coord to[3];//where it goes, or where a new one is put
+        double dipole[3],//its dipole there, for Stockmayer
+               uniform,//the random number the acceptance is checked against
+               delta_pe;
+} speculative_trial;
+
+/*******************************************************************************
+ * The move code is templated on what the particles feel and on which ensemble
+ * is being sampled, so the -ideal, Stockmayer and -NVT checks are constants the
+ * compiler folds away instead of branches in every move. run_simulation looks
+ * at the flags once and calls the matching instantiation.
+ * ****************************************************************************/
+struct Ideal
+{
+        static const bool interacts = false,//no energy at all
+                          dipoles = false;
+};
+
+struct LJ
+{
+        static const bool interacts = true,
+                          dipoles = false;
+};
+
+struct Stockmayer
+{
+        static const bool interacts = true,
+                          dipoles = true;//LJ plus point dipoles
+};
+
+struct NVT
+{
+        static const bool exchanges = false,//translations only
+                          scales = false;
+};
+
+struct MuVT
+{
+        static const bool exchanges = true,//insertions and deletions too
+                          scales = false;
+};
+
+struct NPT
+{
+        static const bool exchanges = false,
+                          scales = true;//translations and volume moves
+};
 
 const double k = 1.0; //boltzmann constant
 const double h = 6.626e-34;//planck constant
@@ -79,30 +458,164 @@ const double conv_factor = 0.0073389366;//converts ATM to K/A^3
 
 void input(GCMC_System *sys);
 
+void store_init(particle_store *store, double box_side_length);
+fixed_coord to_fixed(const particle_store *store, double x);
+double to_angstroms(const particle_store *store, fixed_coord x);
+void store_free(particle_store *store);
+void store_reserve(particle_store *store, int capacity);
+int store_insert(particle_store *store, const particle *p);
+int store_remove(particle_store *store, int slot);
+void store_restore(particle_store *store, int slot, const particle *p);
+void store_permute(particle_store *store, const int *order, void *scratch);
+void store_get(const particle_store *store, int slot, particle *p);
 
-double calculate_PE(GCMC_System *sys);
+void arena_init(scratch_arena *arena);
+void * arena_alloc(scratch_arena *arena, size_t bytes);
+void arena_reset(scratch_arena *arena);
+void arena_free(scratch_arena *arena);
+
+template<class Potential> double calculate_PE(GCMC_System *sys);
+double dipole_energy(GCMC_System *sys, int id_a, int id_b);
+template<class Potential>
+double particle_energy(GCMC_System *sys, int id, double limit,
+                       pair_lists *lists);
+double lj_particle_energy(GCMC_System *sys, int id, bool later_only,
+                          double limit, pair_lists *lists);
+void set_lj_params(GCMC_System *sys);
+template<class Potential>
+double check_drift(GCMC_System *sys, double running_pe);
+double tail_energy(GCMC_System *sys, int n);
+double tail_pressure(GCMC_System *sys, double density);
+void minimum_image(GCMC_System *sys, int id_a, int id_b, double deltas[3]);
 double distfinder(GCMC_System *sys, int id_a, int id_b);
 
-double random_range(double min, double max);
+void build_cells(GCMC_System *sys);
+void shift_cells(GCMC_System *sys, const fixed_coord offset[3]);
+int cell_at(GCMC_System *sys, const fixed_coord p[3]);
+int cell_index(GCMC_System *sys, int id);
+void cell_insert(GCMC_System *sys, int id);
+void cell_remove(GCMC_System *sys, int id);
+void cell_update(GCMC_System *sys, int id);
+void cell_relabel(GCMC_System *sys, int from, int to);
+void gather_neighbors(GCMC_System *sys, int id, pair_lists *lists);
+void gather_cell(GCMC_System *sys, int home, int skip, pair_lists *lists);
+void reorder_particles(GCMC_System *sys);
+
+double lj_kernel_scalar(const fixed_coord *x, const fixed_coord *y,
+                        const fixed_coord *z, int n, const fixed_coord p[3],
+                        const lj_params *lj);
+void lj_moments_scalar(const fixed_coord *x, const fixed_coord *y,
+                       const fixed_coord *z, int n, const fixed_coord p[3],
+                       const lj_params *lj, lj_moments *sum);
+void select_kernel(GCMC_System *sys, const char *requested);
+bool check_kernel(GCMC_System *sys);
+
+double table_kernel(const fixed_coord *x, const fixed_coord *y,
+                    const fixed_coord *z, int n, const fixed_coord p[3],
+                    const lj_params *lj);
+bool build_table(GCMC_System *sys, const char *file);
+
+void start_threads(GCMC_System *sys, int threads);
+void stop_threads(GCMC_System *sys);
+void pool_run(thread_pool *pool, int count, pool_task task, void *context);
+typedef double (*range_sum)(GCMC_System *sys, int begin, int end,
+                            const void *context, pair_lists *lists);
+double parallel_sum(GCMC_System *sys, int items, int chunk, range_sum sum,
+                    const void *context);
+
+void rng_seed(split_rng *rng, uint64_t key, uint64_t stream);
+double rng_uniform(split_rng *rng);
+double random_range(GCMC_System *sys, double min, double max);
+int random_index(GCMC_System *sys, int n);
+uint64_t random_seed();
+template<class Potential, class Ensemble>
 MoveType make_move(GCMC_System *sys);
 
-double ** matrix_madness(GCMC_System *sys);
-double * pick_dipole_direction(GCMC_System *sys);
+void pick_dipole_direction(GCMC_System *sys, double dipole[3]);
+void turn_dipole(GCMC_System *sys, double dipole[3], double max_angle);
+double displacement_reach(GCMC_System *sys);
+void tune_record(GCMC_System *sys, MoveType move_type, bool accepted);
+void freeze_tuning(GCMC_System *sys);
+void place_lattice(GCMC_System *sys, int n);
 
-void create_particle(GCMC_System *sys);
-void move_particle(GCMC_System *sys, int pick);
-void destroy_particle(GCMC_System *sys, int pick);
+template<class Potential> void create_particle(GCMC_System *sys);
+template<class Potential> void move_particle(GCMC_System *sys, int pick);
+template<class Potential> void destroy_particle(GCMC_System *sys, int pick);
+void scale_box(GCMC_System *sys, double side, double cutoff);
+template<class Potential> void change_volume(GCMC_System *sys);
 
+double acceptance_ratio(GCMC_System *sys, double delta, MoveType move_type,
+                        int pool);
+double rejection_limit(GCMC_System *sys, double prefactor, double uniform);
 bool move_accepted(double cpe, double npe, MoveType move_type,\
                    GCMC_System *sys);
 
-void undo_move(GCMC_System *sys, MoveType move);
+template<class Potential> void undo_move(GCMC_System *sys, MoveType move);
 void undo_insertion(GCMC_System *sys);
-void unmove_particle(GCMC_System *sys);
+template<class Potential> void unmove_particle(GCMC_System *sys);
 
 double sphere_volume(GCMC_System *sys,double diameter);
 void radialDistribution( GCMC_System *sys,int step);
 
 void output(GCMC_System *sys,double accepted_energy);
+void histogram_add(GCMC_System *sys);
+void write_histogram(GCMC_System *sys, FILE *out);
+void block_add(GCMC_System *sys);
+void start_production(GCMC_System *sys);
+void write_block_summary(GCMC_System *sys, FILE *out);
+void write_radial(GCMC_System *sys);
+
+template<class Potential, class Ensemble> void mc_step(GCMC_System *sys);
+template<class Potential, class Ensemble>
+void speculative_step(GCMC_System *sys);
+template<class Potential, class Ensemble>
+void checkerboard_step(GCMC_System *sys);
+template<class Potential, class Ensemble>
+void simulate(GCMC_System *sys, int until);
+void run_simulation(GCMC_System *sys, int until);
+
+void copy_system(GCMC_System *copy, const particle_store *start);
+void free_copy(GCMC_System *copy);
+void close_outputs(GCMC_System *copy);
+void resize_box(GCMC_System *sys, double side);
+bool gibbs_transfer(GCMC_System *from, GCMC_System *to);
+bool gibbs_volume(GCMC_System *a, GCMC_System *b, double max_step);
+void run_gibbs(GCMC_System *base, int particles, int sync_interval);
+FILE * numbered_file(const char *name, const char *extension, int m);
+bool read_replicas(const char *file, std::vector<double> *temperatures,
+                   std::vector<double> *pressures);
+void run_replicas(GCMC_System *base, const std::vector<double> &temperatures,
+                  const std::vector<double> &pressures, int swap_interval);
+
+//one state point of a batch run, read from the job list
+typedef struct _batch_job
+{
+        double temperature,
+               pressure;
+        bool warm;//start from the previous job's end if that one converged
+        char directory[256];//where its files go
+        //filled in when it has run
+        double average_particles,
+               average_energy;
+        bool warm_started,
+             converged;
+} batch_job;
+
+bool write_checkpoint(GCMC_System *sys, const char *file);
+bool read_checkpoint(GCMC_System *sys, const char *file, bool any_side);
+void checkpoint_copy(GCMC_System *copy, int m, const char *name);
+void checkpoint_copies(GCMC_System *copies, int count, const char *name);
+void restart_copy(GCMC_System *copy, int m, bool any_side);
+
+bool read_jobs(const char *file, std::vector<batch_job> *jobs);
+void run_batch(GCMC_System *base, std::vector<batch_job> *jobs);
+
+void tmmc_init(GCMC_System *sys, int max_particles);
+double tmmc_collect(GCMC_System *sys, double ratio, MoveType move_type);
+int tmmc_ln_pi(const tmmc_data *t, std::vector<double> *ln_pi);
+void tmmc_update_bias(GCMC_System *sys);
+double tmmc_average(GCMC_System *sys, const std::vector<double> &ln_pi,
+                    int reached, double pressure);
+bool write_ln_pi(GCMC_System *sys, const char *file);
 
 #endif
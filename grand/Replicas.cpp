@@ -0,0 +1,283 @@
+#include "MonteCarlo.h"
+
+/*******************************************************************************
+ * Replica exchange. Near condensation one run at one state point gets stuck in
+ * whichever phase it found first. Running replicas at neighbouring
+ * temperatures and reservoir pressures side by side, and every so often
+ * offering neighbours a swap of configurations, lets a configuration wander up
+ * to where it decorrelates quickly and back down again.
+ *
+ * Every replica is a whole GCMC_System with its own store, cells, arena and
+ * output files, run on one thread at a time. Each round hands one task per
+ * replica to the thread pool; the pool's threads take tasks off a shared
+ * counter, so a thread that finishes an easy replica goes straight on to the
+ * next one instead of waiting. Between rounds the main thread offers swaps to
+ * alternating even and odd neighbour pairs.
+ *
+ * The configurations move and the state points stay put, so everything a
+ * replica averages belongs to one temperature and pressure.
+ * ****************************************************************************/
+
+/*******************************************************************************
+ * read_replicas reads the state points: one "temperature pressure" pair per
+ * line, in kelvin and atm, ordered so that neighbours overlap. Lines starting
+ * with # are comments.
+ * ****************************************************************************/
+bool read_replicas(const char *file, std::vector<double> *temperatures,
+                   std::vector<double> *pressures)
+{
+        FILE * in = fopen(file, "r");
+        if(in == NULL)
+        {
+            printf("Can't open the replica list %s.\n", file);
+            return false;
+        }
+        char line[256];
+        while(fgets(line, sizeof line, in) != NULL)
+        {
+            double t, p;
+            if(line[0] == '#' || sscanf(line, "%lf %lf", &t, &p) != 2)
+            {
+                continue;
+            }
+            if(t <= 0 || p <= 0)
+            {
+                printf("Every replica in %s needs a positive temperature "
+                       "and pressure.\n", file);
+                fclose(in);
+                return false;
+            }
+            temperatures->push_back(t);
+            pressures->push_back(p);
+        }
+        fclose(in);
+        if(temperatures->size() < 2)
+        {
+            printf("The replica list %s needs at least two replicas.\n", file);
+            return false;
+        }
+        return true;
+}
+
+//fopen with a replica's or box's number put in front of the extension
+FILE * numbered_file(const char *name, const char *extension, int m)
+{
+        char path[64];
+        snprintf(path, sizeof path, "%s_%d%s", name, m, extension);
+        return fopen(path, "w");
+}
+
+/*******************************************************************************
+ * copy_system turns copy, a plain struct copy of main's system, into a run of
+ * its own that starts from the particles in start: it gets its own store,
+ * arena, g(r) histogram and cell list, and runs on one thread without
+ * progress reports. Its output files, and its random stream, are left for the
+ * caller to set up.
+ * ****************************************************************************/
+void copy_system(GCMC_System *copy, const particle_store *start)
+{
+        copy->quiet_flag = true;
+        copy->checkpoint_file = NULL;//the drivers checkpoint their copies
+        copy->speculative_moves = 0;
+        copy->pool = NULL;
+        copy->lists.resize(1);
+        copy->boxes = (double*)calloc(copy->nBins, sizeof(double));
+        copy->step = 0;
+        store_init(&copy->particles, copy->box_side_length);
+        for(int s = 0;s<start->count;s++)
+        {
+            particle p;
+            store_get(start, s, &p);
+            p.id = -1;
+            store_insert(&copy->particles, &p);
+        }
+        arena_init(&copy->scratch);
+        build_cells(copy);
+}
+
+//frees what copy_system made
+void free_copy(GCMC_System *copy)
+{
+        free(copy->boxes);
+        store_free(&copy->particles);
+        arena_free(&copy->scratch);
+}
+
+//closes whichever output files the flags say a copy has open
+void close_outputs(GCMC_System *copy)
+{
+        if(copy->energy_output_flag)
+        {
+            fclose(copy->energies);
+        }
+        if(copy->output_flag)
+        {
+            fclose(copy->output);
+        }
+        fclose(copy->unweightedradial);
+        fclose(copy->weightedradial);
+}
+
+//turns a copy of base into replica m, starting from base's particles or
+//from its checkpoint
+static void make_replica(GCMC_System *replica, GCMC_System *base, int m,
+                         double temperature, double pressure)
+{
+        replica->system_temp = temperature;
+        replica->pressure = pressure;
+        copy_system(replica, &base->particles);
+        rng_seed(&replica->rng, base->seed, 1 + m);//main's stream is 0
+        if(replica->restart_file != NULL)
+        {
+            restart_copy(replica, m, false);
+        }
+        if(replica->energy_output_flag)
+        {
+            replica->energies = numbered_file("energies", ".dat", m);
+        }
+        if(replica->output_flag)
+        {
+            replica->output = numbered_file("output", ".txt", m);
+        }
+        replica->unweightedradial = numbered_file("unweightedradialdistribution",
+                                                  ".txt", m);
+        replica->weightedradial = numbered_file("weightedradialdistribution",
+                                                ".txt", m);
+}
+
+typedef struct _replica_round
+{
+        GCMC_System * replicas;
+        int until;//every replica runs up to this step
+} replica_round;
+
+static void replica_task(void *context, int task, int worker)
+{
+        replica_round * round = (replica_round*)context;
+        run_simulation(&round->replicas[task], round->until);
+}
+
+/*******************************************************************************
+ * try_swap offers replicas a and b each other's configurations. With k = 1
+ * the grand canonical weight of N particles at energy U is
+ * (beta P V)^N / N! exp(-beta U), up to factors that are the same for both,
+ * so the swap is accepted with
+ *   exp((beta_a - beta_b)(U_a - U_b) + (N_b - N_a) ln(beta_a P_a / beta_b P_b))
+ * which keeps both replicas' ensembles in detailed balance. Replicas at fixed
+ * N only feel the first term.
+ * ****************************************************************************/
+static bool try_swap(GCMC_System *a, GCMC_System *b)
+{
+        double beta_a = 1.0 / (k * a->system_temp),
+               beta_b = 1.0 / (k * b->system_temp),
+               log_ratio = (beta_a - beta_b) * (a->current_pe - b->current_pe) +
+                           (b->particles.count - a->particles.count) *
+                           log(beta_a * a->pressure / (beta_b * b->pressure));
+        if(exp(log_ratio) <= random_range(a, 0,1))
+        {
+            return false;
+        }
+        std::swap(a->particles, b->particles);
+        std::swap(a->cells, b->cells);
+        std::swap(a->current_pe, b->current_pe);
+        return true;
+}
+
+/*******************************************************************************
+ * run_replicas runs one replica per state point, using base (set up by main up
+ * to its cell list) as the template for all of them, and offers swaps every
+ * swap_interval steps. Each replica writes its own energies, output and g(r)
+ * files with its number in the name. The replicas' averages and how often
+ * each pair of neighbours swapped are printed at the end.
+ * ****************************************************************************/
+void run_replicas(GCMC_System *base, const std::vector<double> &temperatures,
+                  const std::vector<double> &pressures, int swap_interval)
+{
+        int count = temperatures.size();
+        std::vector<GCMC_System> replicas(count, *base);
+        for(int m = 0;m<count;m++)
+        {
+            make_replica(&replicas[m], base, m, temperatures[m], pressures[m]);
+        }
+        std::vector<int> attempts(count - 1, 0),
+                         accepted(count - 1, 0);
+        if(swap_interval < 1)
+        {
+            swap_interval = 1;
+        }
+        int tenth = base->maxStep / 10 > 0 ? base->maxStep / 10 : 1;
+        replica_round round = {replicas.data(), 0};
+        for(int r = 0;round.until < base->maxStep;r++)
+        {
+            int previous = round.until;
+            round.until = std::min(round.until + swap_interval, base->maxStep);
+            if(base->pool == NULL)
+            {
+                for(int m = 0;m<count;m++)
+                {
+                    replica_task(&round, m, 0);
+                }
+            }
+            else
+            {
+                pool_run(base->pool, count, replica_task, &round);
+            }
+            if(round.until / tenth != previous / tenth)
+            {
+                double cycles_till_now = (double)(clock()-base->start_time),
+                       time_till_now = cycles_till_now/CLOCKS_PER_SEC;
+                printf("  %.0f%% of iteration steps done. Time elapsed:"\
+                        " %.2lf seconds.\n",\
+                        ((double)round.until/(double)base->maxStep)*100,
+                        time_till_now);
+                checkpoint_copies(replicas.data(), count,
+                                  base->checkpoint_file);
+            }
+            if(round.until == base->maxStep)
+            {
+                break;//nothing left to run after a swap
+            }
+            for(int m = r % 2;m+1<count;m += 2)
+            {
+                attempts[m]++;
+                if(try_swap(&replicas[m], &replicas[m+1]))
+                {
+                    accepted[m]++;
+                }
+            }
+        }
+        checkpoint_copies(replicas.data(), count, base->checkpoint_file);
+        printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+        printf("|                     REPLICA  RESULTS                     |\n");
+        printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+        for(int m = 0;m<count;m++)
+        {
+            GCMC_System * replica = &replicas[m];
+            printf("Replica %d at %.2lf K and %g atm:\n"
+                   "\tAverage number of particles: %lf\n"
+                   "\tAverage energy: %lf K\n", m, replica->system_temp,
+                   replica->pressure,
+                   replica->sumparticles/replica->production_steps,
+                   replica->sumenergy/replica->production_steps);
+        }
+        for(int m = 0;m+1<count;m++)
+        {
+            printf("Swaps between replicas %d and %d: %d of %d accepted "
+                   "(%.1lf%%)\n", m, m+1, accepted[m], attempts[m],
+                   attempts[m] > 0 ? 100.0 * accepted[m] / attempts[m] : 0.0);
+        }
+        for(int m = 0;m<count;m++)
+        {
+            if(replicas[m].histogram.bin_width > 0)
+            {
+                FILE * histogram = numbered_file("histogram", ".txt", m);
+                if(histogram != NULL)
+                {
+                    write_histogram(&replicas[m], histogram);
+                    fclose(histogram);
+                }
+            }
+            close_outputs(&replicas[m]);
+            free_copy(&replicas[m]);
+        }
+}
@@ -0,0 +1,164 @@
+#include "MonteCarlo.h"
+
+/*******************************************************************************
+ * Transition-matrix Monte Carlo. An isotherm from plain GCMC is one long run
+ * per pressure, each only telling us <N> there. -tmmc instead samples every N
+ * up to a limit in one run and works out ln Pi(N), the log of the probability
+ * of N particles at the run's temperature and pressure. Pi at any other
+ * reservoir pressure P' follows from
+ *   ln Pi(N; P') = ln Pi(N; P) + N ln(P'/P)
+ * (then normalized), since the reservoir only enters as (beta P V)^N, so the
+ * whole isotherm at this temperature comes out of one run.
+ *
+ * Every insertion and deletion adds its unbiased acceptance probability,
+ * min(1, ratio) from acceptance_ratio, to the collection matrix for the N it
+ * started from, whether or not it is then accepted. The moves themselves are
+ * accepted with the ratio times exp(bias(N') - bias(N)), where the bias is the
+ * current estimate of -ln Pi, which flattens the walk in N so that every N is
+ * visited about as often. The bias is refreshed from the collection matrix
+ * every TMMC_UPDATE_INTERVAL steps.
+ * ****************************************************************************/
+
+void tmmc_init(GCMC_System *sys, int max_particles)
+{
+        tmmc_data * t = &sys->tmmc;
+        t->max_particles = max_particles;
+        t->up.assign(max_particles + 1, 0);
+        t->down.assign(max_particles + 1, 0);
+        t->up_tries.assign(max_particles + 1, 0);
+        t->down_tries.assign(max_particles + 1, 0);
+        t->bias.assign(max_particles + 1, 0);
+        t->visits.assign(max_particles + 1, 0);
+}
+
+/*******************************************************************************
+ * tmmc_collect adds a move with Metropolis ratio ratio to the collection
+ * matrix and returns the ratio it should be accepted with instead. The move
+ * has already been made, so an insertion started from one particle fewer than
+ * there are now and a deletion from one more. Insertions past max_particles
+ * are counted but never accepted.
+ * ****************************************************************************/
+double tmmc_collect(GCMC_System *sys, double ratio, MoveType move_type)
+{
+        tmmc_data * t = &sys->tmmc;
+        int now = sys->particles.count;
+        if(move_type == CREATE_PARTICLE)
+        {
+            t->up[now - 1] += std::min(ratio, 1.0);
+            t->up_tries[now - 1]++;
+            if(now > t->max_particles)
+            {
+                return 0;
+            }
+            return ratio * exp(t->bias[now] - t->bias[now - 1]);
+        }
+        else if(move_type == DESTROY_PARTICLE)
+        {
+            t->down[now + 1] += std::min(ratio, 1.0);
+            t->down_tries[now + 1]++;
+            return ratio * exp(t->bias[now] - t->bias[now + 1]);
+        }
+        return ratio;//translations don't change N
+}
+
+/*******************************************************************************
+ * tmmc_ln_pi works ln Pi(N) out of the collection matrix, with ln Pi(0) = 0,
+ * from the mean probabilities of going up from N and down from N+1. It stops
+ * at the first N that hasn't been crossed both ways yet and returns the last
+ * N it has a value for.
+ * ****************************************************************************/
+int tmmc_ln_pi(const tmmc_data *t, std::vector<double> *ln_pi)
+{
+        ln_pi->assign(t->max_particles + 1, 0);
+        int n = 0;
+        for(;n<t->max_particles;n++)
+        {
+            if(t->up[n] <= 0 || t->down[n+1] <= 0)
+            {
+                break;
+            }
+            (*ln_pi)[n+1] = (*ln_pi)[n] + log(t->up[n] / t->up_tries[n]) -
+                            log(t->down[n+1] / t->down_tries[n+1]);
+        }
+        return n;
+}
+
+//sets the bias to -ln Pi as far as it is known, and flat past that so the
+//walk can carry on into N it hasn't reached
+void tmmc_update_bias(GCMC_System *sys)
+{
+        tmmc_data * t = &sys->tmmc;
+        std::vector<double> ln_pi;
+        int reached = tmmc_ln_pi(t, &ln_pi);
+        for(int n = 0;n<=t->max_particles;n++)
+        {
+            t->bias[n] = -ln_pi[std::min(n, reached)];
+        }
+}
+
+//<N> at reservoir pressure pressure, from ln Pi up to reached measured at
+//the run's pressure
+double tmmc_average(GCMC_System *sys, const std::vector<double> &ln_pi,
+                    int reached, double pressure)
+{
+        double shift = log(pressure / sys->pressure),
+               top = -HUGE_VAL;
+        for(int n = 0;n<=reached;n++)
+        {
+            top = fmax(top, ln_pi[n] + n * shift);
+        }
+        double total = 0,
+               weighted = 0;
+        for(int n = 0;n<=reached;n++)
+        {
+            double weight = exp(ln_pi[n] + n * shift - top);
+            total += weight;
+            weighted += n * weight;
+        }
+        return weighted / total;
+}
+
+/*******************************************************************************
+ * write_ln_pi writes ln Pi(N), normalized so the probabilities add up to one,
+ * for every N the run got to, with how often each N was visited and how many
+ * insertions and deletions were tried from it. It prints <N> at the run's
+ * pressure and returns false if the file can't be written.
+ * ****************************************************************************/
+bool write_ln_pi(GCMC_System *sys, const char *file)
+{
+        tmmc_data * t = &sys->tmmc;
+        std::vector<double> ln_pi;
+        int reached = tmmc_ln_pi(t, &ln_pi);
+        double top = -HUGE_VAL,
+               total = 0;
+        for(int n = 0;n<=reached;n++)
+        {
+            top = fmax(top, ln_pi[n]);
+        }
+        for(int n = 0;n<=reached;n++)
+        {
+            total += exp(ln_pi[n] - top);
+        }
+        double norm = top + log(total);
+        printf("TMMC reached N = %d of %d\n"
+               "Average number of particles from ln Pi: %lf\n", reached,
+               t->max_particles, tmmc_average(sys, ln_pi, reached,
+                                              sys->pressure));
+        FILE * out = fopen(file, "w");
+        if(out == NULL)
+        {
+            printf("Can't write %s.\n", file);
+            return false;
+        }
+        fprintf(out, "# ln Pi(N) at %lf K and %g atm; at another pressure P'"
+                     " add N ln(P'/%g) and renormalize\n"
+                     "# N\tln Pi(N)\tvisits\tinsertions\tdeletions\n",
+                sys->system_temp, sys->pressure, sys->pressure);
+        for(int n = 0;n<=reached;n++)
+        {
+            fprintf(out, "%d\t%.10lf\t%.0lf\t%.0lf\t%.0lf\n", n, ln_pi[n] - norm,
+                    t->visits[n], t->up_tries[n], t->down_tries[n]);
+        }
+        fclose(out);
+        return true;
+}
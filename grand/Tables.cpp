@@ -0,0 +1,287 @@
+#include "MonteCarlo.h"
+
+/*******************************************************************************
+ * table_kernel is the kernel for tabulated potentials. It walks the particles
+ * like lj_kernel_scalar does, but each pair inside the cutoff costs the same
+ * spline lookup whatever the potential is. A pair closer than the start of the
+ * table is a hard overlap: the sum stops there and comes back as HUGE_VAL, so
+ * no move that makes one is ever accepted, however soft the table's first
+ * value is.
+ * ****************************************************************************/
+double table_kernel(const fixed_coord *x, const fixed_coord *y,
+                    const fixed_coord *z, int n, const fixed_coord p[3],
+                    const lj_params *lj)
+{
+        const pair_table * table = lj->table;
+        const real scale = lj->scale,
+                   cutoff_squared = lj->cutoff_squared,
+                   r2_min = table->r2_min,
+                   inverse_spacing = table->inverse_spacing;
+        const real * coefficients = table->coefficients.data();
+        const int last = table->intervals - 1;
+        double pe = 0.00;
+        for(int j = 0;j<n;j++)
+        {
+            real dx = (real)(int32_t)(p[0] - x[j]) * scale,
+                 dy = (real)(int32_t)(p[1] - y[j]) * scale,
+                 dz = (real)(int32_t)(p[2] - z[j]) * scale,
+                 r2 = dx*dx + dy*dy + dz*dz;
+            if(r2 < cutoff_squared)
+            {
+                if(r2 < r2_min)
+                {
+                    return HUGE_VAL;
+                }
+                real t = (r2 - r2_min) * inverse_spacing;
+                int i = (int)t;
+                if(i > last)
+                {
+                    i = last;
+                }
+                real f = t - i;
+                const real * c = coefficients + 4 * i;
+                pe += c[0] + f * (c[1] + f * (c[2] + f * c[3]));
+            }
+        }
+        return pe;
+}
+
+/*******************************************************************************
+ * natural_spline fills y2 with the second derivatives of the natural cubic
+ * spline through the n points (x, y), x increasing. It's the usual tridiagonal
+ * solve; the spline is straight at both ends.
+ * ****************************************************************************/
+static void natural_spline(const double *x, const double *y, int n, double *y2)
+{
+        std::vector<double> u(n);
+        y2[0] = u[0] = 0;
+        for(int i = 1;i<n-1;i++)
+        {
+            double sig = (x[i] - x[i-1]) / (x[i+1] - x[i-1]),
+                   p = sig * y2[i-1] + 2.0;
+            y2[i] = (sig - 1.0) / p;
+            u[i] = (y[i+1] - y[i]) / (x[i+1] - x[i]) -
+                   (y[i] - y[i-1]) / (x[i] - x[i-1]);
+            u[i] = (6.0 * u[i] / (x[i+1] - x[i-1]) - sig * u[i-1]) / p;
+        }
+        y2[n-1] = 0;
+        for(int i = n-2;i>=0;i--)
+        {
+            y2[i] = y2[i] * y2[i+1] + u[i];
+        }
+}
+
+//how far from 0 a user table that stops inside the cutoff can end, as a
+//fraction of the largest energy from its lowest point out
+#define TABLE_END_TOLERANCE 1e-3
+
+//value of the spline from natural_spline at x, which has to be inside it
+static double spline_at(const double *x, const double *y, const double *y2,
+                        int n, double at)
+{
+        int low = 0,
+            high = n - 1;
+        while(high - low > 1)
+        {
+            int middle = (low + high) / 2;
+            if(x[middle] > at)
+            {
+                high = middle;
+            }
+            else
+            {
+                low = middle;
+            }
+        }
+        double h = x[high] - x[low],
+               a = (x[high] - at) / h,
+               b = (at - x[low]) / h;
+        return a * y[low] + b * y[high] +
+               ((a*a*a - a) * y2[low] + (b*b*b - b) * y2[high]) * h * h / 6.0;
+}
+
+/*******************************************************************************
+ * read_table reads a user's potential: one "r energy" pair per line, r in
+ * angstroms and the energy in kelvin, with r increasing. Lines starting with #
+ * are comments. The points come back in r^2 with their spline, so they can be
+ * sampled anywhere in between. A table that stops short of r2_max has to have
+ * come down to 0 by then, since it's 0 from there on and a step would set the
+ * spline ringing.
+ * ****************************************************************************/
+static bool read_table(const char *file, double r2_max,
+                       std::vector<double> *r2, std::vector<double> *energy,
+                       std::vector<double> *y2)
+{
+        FILE * in = fopen(file, "r");
+        if(in == NULL)
+        {
+            printf("Can't open the potential table %s.\n", file);
+            return false;
+        }
+        char line[256];
+        while(fgets(line, sizeof line, in) != NULL)
+        {
+            double r, e;
+            if(line[0] == '#' || sscanf(line, "%lf %lf", &r, &e) != 2)
+            {
+                continue;
+            }
+            if(r <= 0 || (!r2->empty() && r * r <= r2->back()))
+            {
+                printf("The potential table %s has to go out in r.\n", file);
+                fclose(in);
+                return false;
+            }
+            r2->push_back(r * r);
+            energy->push_back(e);
+        }
+        fclose(in);
+        if(r2->size() < 4)
+        {
+            printf("The potential table %s needs at least four points.\n",
+                   file);
+            return false;
+        }
+        int n = r2->size(),
+            lowest = std::min_element(energy->begin(), energy->end()) -
+                     energy->begin();
+        double largest = 0;
+        for(int i = lowest;i<n;i++)
+        {
+            largest = fmax(largest, fabs((*energy)[i]));
+        }
+        if(r2->back() < r2_max &&
+           fabs(energy->back()) > TABLE_END_TOLERANCE * largest)
+        {
+            printf("The potential table %s ends at %lf A with %g K, inside "
+                   "the cutoff;\nit has to go on to the cutoff or down to "
+                   "0.\n", file, sqrt(r2->back()), energy->back());
+            return false;
+        }
+        y2->resize(r2->size());
+        natural_spline(r2->data(), energy->data(), r2->size(), y2->data());
+        return true;
+}
+
+//lowest value of one piece of the table, c0 + c1 f + c2 f^2 + c3 f^3 for f
+//from 0 to 1: at one of its ends or where its slope is 0
+static double piece_minimum(const real *c)
+{
+        double lowest = fmin(c[0], c[0] + c[1] + c[2] + c[3]),
+               a = 3.0 * c[3],
+               b = 2.0 * c[2],
+               roots[2];
+        int count = 0;
+        if(a == 0)
+        {
+            if(b != 0)
+            {
+                roots[count++] = -c[1] / b;
+            }
+        }
+        else
+        {
+            double discriminant = b * b - 4.0 * a * c[1];
+            if(discriminant >= 0)
+            {
+                roots[count++] = (-b + sqrt(discriminant)) / (2.0 * a);
+                roots[count++] = (-b - sqrt(discriminant)) / (2.0 * a);
+            }
+        }
+        for(int r = 0;r<count;r++)
+        {
+            double f = roots[r];
+            if(f > 0 && f < 1)
+            {
+                lowest = fmin(lowest,
+                              c[0] + f * (c[1] + f * (c[2] + f * c[3])));
+            }
+        }
+        return lowest;
+}
+
+/*******************************************************************************
+ * build_table fills sys->table, either from the Lennard-Jones parameters
+ * input() chose or, if file isn't NULL, from a user's table. Either way the
+ * potential is sampled on the table's own even grid in r^2 and splined there,
+ * with the shift taken off if -shift is on. The table starts at 0.7 sigma for
+ * Lennard-Jones and at the first point of a user's table, and pairs any closer
+ * are overlaps. A user table is zero past its last point.
+ * ****************************************************************************/
+bool build_table(GCMC_System *sys, const char *file)
+{
+        std::vector<double> file_r2, file_energy, file_y2;
+        double r2_min = 0.49 * sys->sigma_squared,
+               r2_max = sys->cutoff * sys->cutoff;
+        if(file != NULL && !read_table(file, r2_max, &file_r2, &file_energy,
+                                       &file_y2))
+        {
+            return false;
+        }
+        pair_table * table = &sys->table;
+        if(file != NULL)
+        {
+            r2_min = file_r2.front();
+            if(r2_min >= r2_max)
+            {
+                printf("The potential table %s starts past the cutoff.\n",
+                       file);
+                return false;
+            }
+        }
+        int intervals = TABLE_INTERVALS;
+        double spacing = (r2_max - r2_min) / intervals;
+        std::vector<double> grid(intervals + 1), energy(intervals + 1),
+                            y2(intervals + 1);
+        for(int k = 0;k<=intervals;k++)
+        {
+            double r2 = r2_min + k * spacing;
+            grid[k] = k;
+            if(file == NULL)
+            {
+                double sr6 = sys->sigma_sixth / (r2 * r2 * r2);
+                energy[k] = 4.0 * sys->epsilon * (sr6 * sr6 - sr6);
+            }
+            else if(r2 >= file_r2.back())
+            {
+                energy[k] = 0;
+            }
+            else
+            {
+                energy[k] = spline_at(file_r2.data(), file_energy.data(),
+                                      file_y2.data(), file_r2.size(), r2);
+            }
+        }
+        if(sys->shift_flag)
+        {
+            double shift = energy[intervals];
+            for(int k = 0;k<=intervals;k++)
+            {
+                energy[k] -= shift;
+            }
+        }
+        //the grid is in units of intervals, so each piece runs from 0 to 1
+        natural_spline(grid.data(), energy.data(), intervals + 1, y2.data());
+        table->r2_min = r2_min;
+        table->inverse_spacing = 1.0 / spacing;
+        table->intervals = intervals;
+        table->coefficients.resize(4 * intervals);
+        for(int i = 0;i<intervals;i++)
+        {
+            real * c = &table->coefficients[4 * i];
+            c[0] = energy[i];
+            c[1] = energy[i+1] - energy[i] - (2.0 * y2[i] + y2[i+1]) / 6.0;
+            c[2] = y2[i] / 2.0;
+            c[3] = (y2[i+1] - y2[i]) / 6.0;
+        }
+        //how far one pair can pull an energy down, for early rejections;
+        //pairs past the cutoff are 0
+        table->floor = 0;
+        for(int i = 0;i<intervals;i++)
+        {
+            table->floor = fmin(table->floor,
+                                piece_minimum(&table->coefficients[4 * i]));
+        }
+        sys->lj.floor = table->floor;
+        return true;
+}
@@ -0,0 +1,150 @@
+#include "MonteCarlo.h"
+
+//takes tasks until there are none left in this batch
+static void run_tasks(thread_pool *pool, int worker)
+{
+        for(int t = pool->next_task++;t<pool->task_count;t = pool->next_task++)
+        {
+            pool->task(pool->context, t, worker);
+        }
+}
+
+static void worker_loop(thread_pool *pool, int worker)
+{
+        long seen = 0;
+        std::unique_lock<std::mutex> hold(pool->lock);
+        for(;;)
+        {
+            pool->wake.wait(hold, [&]{ return pool->stopping ||
+                                              pool->batch != seen; });
+            if(pool->stopping)
+            {
+                return;
+            }
+            seen = pool->batch;
+            hold.unlock();
+            run_tasks(pool, worker);
+            hold.lock();
+            if(--pool->busy == 0)
+            {
+                pool->done.notify_one();
+            }
+        }
+}
+
+void pool_run(thread_pool *pool, int count, pool_task task, void *context)
+{
+        {
+            std::lock_guard<std::mutex> hold(pool->lock);
+            pool->task = task;
+            pool->context = context;
+            pool->task_count = count;
+            pool->next_task = 0;
+            pool->busy = pool->threads.size();
+            pool->batch++;
+        }
+        pool->wake.notify_all();
+        run_tasks(pool, 0);
+        std::unique_lock<std::mutex> hold(pool->lock);
+        pool->done.wait(hold, [&]{ return pool->busy == 0; });
+}
+
+/*******************************************************************************
+ * start_threads gives every thread its own pair_lists and, for more than one
+ * thread, starts the pool. It has to be called before anything looks for
+ * neighbours, even on one thread.
+ * ****************************************************************************/
+void start_threads(GCMC_System *sys, int threads)
+{
+        if(threads < 1)
+        {
+            threads = 1;
+        }
+        sys->lists.resize(threads);
+        sys->pool = NULL;
+        if(threads == 1)
+        {
+            return;
+        }
+        thread_pool * pool = new thread_pool;
+        pool->batch = 0;
+        pool->busy = 0;
+        pool->stopping = false;
+        for(int w = 1;w<threads;w++)
+        {
+            pool->threads.push_back(std::thread(worker_loop, pool, w));
+        }
+        sys->pool = pool;
+}
+
+void stop_threads(GCMC_System *sys)
+{
+        thread_pool * pool = sys->pool;
+        if(pool == NULL)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> hold(pool->lock);
+            pool->stopping = true;
+        }
+        pool->wake.notify_all();
+        for(std::thread & worker : pool->threads)
+        {
+            worker.join();
+        }
+        delete pool;
+        sys->pool = NULL;
+}
+
+typedef struct _sum_job
+{
+        GCMC_System * sys;
+        int items,
+            chunk;
+        range_sum sum;
+        const void * context;
+        double * partial;
+} sum_job;
+
+static void sum_task(void *context, int task, int worker)
+{
+        sum_job * job = (sum_job*)context;
+        int begin = task * job->chunk,
+            end = begin + job->chunk < job->items ? begin + job->chunk
+                                                  : job->items;
+        job->partial[task] = job->sum(job->sys, begin, end, job->context,
+                                      &job->sys->lists[worker]);
+}
+
+/*******************************************************************************
+ * parallel_sum adds up sum over items 0 to items-1, split into fixed chunks.
+ * Each chunk's total goes in its own slot and the slots are added in order, so
+ * the result only depends on chunk, never on how many threads there are or
+ * which one did what. With one thread or one chunk it all happens right here.
+ * ****************************************************************************/
+double parallel_sum(GCMC_System *sys, int items, int chunk, range_sum sum,
+                    const void *context)
+{
+        int chunks = (items + chunk - 1) / chunk;
+        sum_job job = {sys, items, chunk, sum, context,
+                       (double*)arena_alloc(&sys->scratch,
+                                            chunks * sizeof(double))};
+        if(sys->pool == NULL || chunks < 2)
+        {
+            for(int t = 0;t<chunks;t++)
+            {
+                sum_task(&job, t, 0);
+            }
+        }
+        else
+        {
+            pool_run(sys->pool, chunks, sum_task, &job);
+        }
+        double total = 0.00;
+        for(int t = 0;t<chunks;t++)
+        {
+            total += job.partial[t];
+        }
+        return total;
+}
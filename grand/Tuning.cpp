@@ -0,0 +1,147 @@
+#include "MonteCarlo.h"
+
+/*******************************************************************************
+ * Move tuning. Translations used to reach anywhere in the box and turn dipoles
+ * to any direction, so in a liquid almost all of them were rejected, and the
+ * moves were always a third each creates, destroys and translations. With
+ * -tune, the equilibration phase adjusts these as it goes:
+ *
+ * - the largest displacement, and with it the largest dipole turn, is scaled
+ *   toward TARGET_ACCEPTANCE of translations accepted;
+ * - the NPT volume step is scaled the same way toward TARGET_ACCEPTANCE of
+ *   volume moves;
+ * - the share of exchanges is set so exchanges and translations decorrelate
+ *   the system equally fast. An accepted exchange counts as one fresh N, and
+ *   an accepted translation as min(1, d^2 / sigma^2) of a fresh position. Both
+ *   kinds of move come out of the same CPU seconds, so the split that gives
+ *   the most decorrelation of the slower kind per second is the one that
+ *   makes the two rates equal, whatever each move costs.
+ *
+ * Changing moves as they go breaks detailed balance, so the settings are
+ * frozen when production starts and reported then. Creates and destroys are
+ * always picked equally often, so their acceptance rules never change.
+ * ****************************************************************************/
+
+#define TARGET_ACCEPTANCE 0.4
+//moves between adjustments
+#define TUNE_ATTEMPTS 1000
+//most an adjustment can scale a step by, either way
+#define MAX_TUNE_FACTOR 2.0
+//bounds on the share of exchanges, so neither kind of move is starved
+#define MIN_EXCHANGE_FRACTION 0.1
+#define MAX_EXCHANGE_FRACTION 0.9
+
+//how far translations can reach in each direction
+double displacement_reach(GCMC_System *sys)
+{
+        double reach = sys->tuning.max_displacement;
+        return reach > 0 && reach < sys->half_box ? reach : sys->half_box;
+}
+
+//acceptance over the last batch scaled into a step factor
+static double tune_factor(double accepted, double attempts)
+{
+        double rate = accepted / attempts;
+        return fmin(MAX_TUNE_FACTOR, fmax(1.0 / MAX_TUNE_FACTOR,
+                                          rate / TARGET_ACCEPTANCE));
+}
+
+static void tune_adjust(GCMC_System *sys)
+{
+        move_tuning * t = &sys->tuning;
+        if(t->attempts[TRANSLATE] > 0)
+        {
+            double factor = tune_factor(t->accepted[TRANSLATE],
+                                        t->attempts[TRANSLATE]);
+            t->max_displacement = fmin(displacement_reach(sys) * factor,
+                                       sys->half_box);
+            t->max_rotation = fmin(t->max_rotation * factor, M_PI);
+        }
+        if(t->attempts[CHANGE_VOLUME] > 0)
+        {
+            sys->volume_step = fmin(sys->volume_step *
+                                    tune_factor(t->accepted[CHANGE_VOLUME],
+                                                t->attempts[CHANGE_VOLUME]),
+                                    1.0);
+        }
+        double exchanges = t->attempts[CREATE_PARTICLE] +
+                           t->attempts[DESTROY_PARTICLE];
+        if(exchanges > 0 && t->attempts[TRANSLATE] > 0)
+        {
+            double per_exchange = (t->accepted[CREATE_PARTICLE] +
+                                   t->accepted[DESTROY_PARTICLE]) / exchanges,
+                   per_translation = t->decorrelation / t->attempts[TRANSLATE];
+            if(per_exchange + per_translation > 0)
+            {
+                double best = per_translation / (per_exchange + per_translation);
+                //halfway there each time, since the counts are noisy
+                t->exchange_fraction = fmin(MAX_EXCHANGE_FRACTION,
+                    fmax(MIN_EXCHANGE_FRACTION,
+                         0.5 * (t->exchange_fraction + best)));
+            }
+        }
+        for(int m = 0;m<4;m++)
+        {
+            t->attempts[m] = t->accepted[m] = 0;
+        }
+        t->decorrelation = 0;
+}
+
+/*******************************************************************************
+ * tune_record counts a move mc_step has just accepted or undone, and adjusts
+ * the moves once there have been TUNE_ATTEMPTS of them. An accepted
+ * translation's displacement is still in sys->move.
+ * ****************************************************************************/
+void tune_record(GCMC_System *sys, MoveType move_type, bool accepted)
+{
+        move_tuning * t = &sys->tuning;
+        t->attempts[move_type]++;
+        if(accepted)
+        {
+            t->accepted[move_type]++;
+            if(move_type == TRANSLATE)
+            {
+                double dx = (int32_t)sys->move.phi * sys->lj.scale,
+                       dy = (int32_t)sys->move.gamma * sys->lj.scale,
+                       dz = (int32_t)sys->move.delta * sys->lj.scale;
+                t->decorrelation += fmin(1.0, (dx*dx + dy*dy + dz*dz) /
+                                              sys->sigma_squared);
+            }
+        }
+        if(++t->moves >= TUNE_ATTEMPTS)
+        {
+            tune_adjust(sys);
+            t->moves = 0;
+        }
+}
+
+//stops tuning for production and says what it settled on
+void freeze_tuning(GCMC_System *sys)
+{
+        move_tuning * t = &sys->tuning;
+        if(!t->tuning)
+        {
+            return;
+        }
+        t->tuning = false;
+        if(sys->quiet_flag)
+        {
+            return;
+        }
+        printf("  Tuned moves: largest displacement %.3lf A",
+               displacement_reach(sys));
+        if(sys->stockmayer_flag)
+        {
+            printf(", largest dipole turn %.3lf rad", t->max_rotation);
+        }
+        if(sys->NPT_flag)
+        {
+            printf(", volume step %.4lf", sys->volume_step);
+        }
+        if(!sys->NVT_flag && !sys->NPT_flag)
+        {
+            printf(", exchanges %.1lf%% of moves",
+                   100 * t->exchange_fraction);
+        }
+        printf(".\n");
+}
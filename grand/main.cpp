@@ -4,14 +4,31 @@ int main(int argc, char *argv[])
 {
     GCMC_System sys;
     
-    int n;
-    
-    MoveType move_type;
+    double cutoff_in_sigma = 0;//0 means half the box
+
+    const char * isa = NULL;//NULL means the best one this CPU has
+
+    int threads = 1;
+
+    bool table_flag = false;
+    const char * table_file = NULL;//NULL means tabulate LJ itself
+
+    const char * replica_list = NULL;//NULL means one run, no replicas
+    int swap_interval = 100;
+    std::vector<double> replica_temps, replica_pressures;
+
+    const char * job_list = NULL;//NULL means no batch
+
+    int gibbs_particles = 0;//0 means no Gibbs ensemble
+
+    int start_particles = 0;//on a lattice before the first step
 
-    double currentPE,
-           newPE;
+    int tmmc_particles = 0;//0 means no transition-matrix run
 
-    if(argc < 5 || argc > 8)
+    bool seed_given = false;
+    std::vector<batch_job> jobs;
+
+    if(argc < 5)
     {
             printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n"
                    "|               INPUT ERROR               |\n"
@@ -22,11 +39,70 @@ int main(int argc, char *argv[])
                     "\tthe desired number of iterations,\n"\
                     "\tthe length of one side of the box,\n"\
                     "\tand the desired temperature.\n");
-            printf("It also takes three (optional) flags:\n"
+            printf("It also takes these (optional) flags:\n"
                    "\t-ideal     : simulates an ideal gas\n"
                    "\t-energy    : outputs energy to a file\n"
                    "\t-debug     : lots of output about code\n"
-                   "\t-NVT       : make translations only\n");
+                   "\t-NVT       : make translations only\n"
+                   "\t-NPT       : translations and volume moves; the\n"
+                   "\t             cutoff scales with the box, so use\n"
+                   "\t             -tail for a model that doesn't change\n"
+                   "\t             with the volume\n"
+                   "\t-particles n : start with n particles on a lattice\n"
+                   "\t             (-NVT and -NPT need some)\n"
+                   "\t-pressure p : in atm, for -NPT or the GCMC\n"
+                   "\t             reservoir (default is 1)\n"
+                   "\t-cutoff r  : interaction cutoff in units of sigma\n"
+                   "\t             (default is half the box)\n"
+                   "\t-shift     : shift LJ to zero at the cutoff, for\n"
+                   "\t             the truncated and shifted model\n"
+                   "\t-tail      : add long range tail corrections, for\n"
+                   "\t             full LJ (needs the unshifted sum, so\n"
+                   "\t             not with -shift)\n"
+                   "\t-isa name  : force the scalar, sse2, avx2 or avx512\n"
+                   "\t             energy kernel (default is the best)\n"
+                   "\t-table     : look LJ up in a spline table\n"
+                   "\t-tablefile name : use the pair potential in name\n"
+                   "\t             (lines of r in A and energy in K)\n"
+                   "\t-threads n : split energy sums and g(r) over n\n"
+                   "\t             threads (default is 1)\n"
+                   "\t-reorder n : sort particles along a Morton curve\n"
+                   "\t             every n steps (default is never)\n"
+                   "\t-checkerboard : sweep the cells eight colours at a\n"
+                   "\t             time, one move per cell per step\n"
+                   "\t-speculate k : evaluate the next k trial moves at\n"
+                   "\t             once on the threads, keeping them up\n"
+                   "\t             to the first accepted one\n"
+                   "\t-replicas name : replica exchange over the state\n"
+                   "\t             points in name (lines of T in K and\n"
+                   "\t             P in atm), one replica per line\n"
+                   "\t-swap n    : steps between replica swaps or\n"
+                   "\t             Gibbs transfers and volume moves\n"
+                   "\t             (default is 100)\n"
+                   "\t-batch name : run every job in name (lines of T in\n"
+                   "\t             K, P in atm, and optionally warm and\n"
+                   "\t             a directory) on the threads\n"
+                   "\t-gibbs n   : Gibbs ensemble of n particles in two\n"
+                   "\t             boxes of this size (needs -cutoff)\n"
+                   "\t-tmmc n    : transition-matrix MC over 0 to n\n"
+                   "\t             particles, writing ln Pi(N) to lnpi.txt\n"
+                   "\t-histogram w : count (N, E) in E bins w K wide over\n"
+                   "\t             the second half, for the reweight tool\n"
+                   "\t-converge dE dN : start production once settled and\n"
+                   "\t             stop when the error bars of E (in K)\n"
+                   "\t             and N are under dE and dN\n"
+                   "\t-block n   : steps per block for the error bars\n"
+                   "\t             (default is 1000)\n"
+                   "\t-tune      : tune displacements and the move mix\n"
+                   "\t             until production starts\n"
+                   "\t-seed n    : seed the random streams with n\n"
+                   "\t             (default is from the clock)\n"
+                   "\t-checkpoint name : save the particles and random\n"
+                   "\t             stream to name as the run goes; replica,\n"
+                   "\t             job or Gibbs box m saves to name.m\n"
+                   "\t-restart name : start from the checkpoint in name,\n"
+                   "\t             carrying on with its seed; replica, job\n"
+                   "\t             or Gibbs box m starts from name.m\n");
             exit(EXIT_FAILURE);
     }
 
@@ -38,6 +114,9 @@ int main(int argc, char *argv[])
     sys.stockmayer_flag = false;
     sys.debug_flag = false;
     sys.NVT_flag = false;
+    sys.shift_flag = false;
+    sys.tail_flag = false;
+    sys.checkerboard_flag = false;
     
     //take flags if specified
     for(int i = 1;i < argc;i++)
@@ -72,6 +151,180 @@ int main(int argc, char *argv[])
             arg_count++;
             continue;
         }
+        else if(strcmp(argv[i],"-NPT")==0)
+        {
+            sys.NPT_flag = true;
+            arg_count++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-particles")==0 && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%d", &start_particles);
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-pressure")==0 && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%lf", &sys.pressure);
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-shift")==0)
+        {
+            sys.shift_flag = true;
+            arg_count++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-tail")==0)
+        {
+            sys.tail_flag = true;
+            arg_count++;
+            continue;
+        }
+        else if((strcmp(argv[i],"-seed")==0 || strcmp(argv[i],"--seed")==0)
+                && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%" SCNu64, &sys.seed);
+            seed_given = true;
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-checkpoint")==0 && i+1 < argc)
+        {
+            sys.checkpoint_file = argv[i+1];
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-restart")==0 && i+1 < argc)
+        {
+            sys.restart_file = argv[i+1];
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-tune")==0)
+        {
+            sys.tuning.tuning = true;
+            arg_count++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-checkerboard")==0)
+        {
+            sys.checkerboard_flag = true;
+            arg_count++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-isa")==0 && i+1 < argc)
+        {
+            isa = argv[i+1];
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-table")==0)
+        {
+            table_flag = true;
+            arg_count++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-tablefile")==0 && i+1 < argc)
+        {
+            table_flag = true;
+            table_file = argv[i+1];
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-threads")==0 && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%d", &threads);
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-speculate")==0 && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%d", &sys.speculative_moves);
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-replicas")==0 && i+1 < argc)
+        {
+            replica_list = argv[i+1];
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-batch")==0 && i+1 < argc)
+        {
+            job_list = argv[i+1];
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-gibbs")==0 && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%d", &gibbs_particles);
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-tmmc")==0 && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%d", &tmmc_particles);
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-histogram")==0 && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%lf", &sys.histogram.bin_width);
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-converge")==0 && i+2 < argc)
+        {
+            sys.converge_flag = true;
+            sscanf(argv[i+1], "%lf", &sys.blocks.energy_target);
+            sscanf(argv[i+2], "%lf", &sys.blocks.particle_target);
+            arg_count += 3;
+            i += 2;
+            continue;
+        }
+        else if(strcmp(argv[i],"-block")==0 && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%d", &sys.blocks.block_steps);
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-swap")==0 && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%d", &swap_interval);
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-reorder")==0 && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%d", &sys.reorder_interval);
+            arg_count += 2;
+            i++;
+            continue;
+        }
+        else if(strcmp(argv[i],"-cutoff")==0 && i+1 < argc)
+        {
+            sscanf(argv[i+1], "%lf", &cutoff_in_sigma);
+            arg_count += 2;
+            i++;
+            continue;
+        }
     }
 
     printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
@@ -104,21 +357,239 @@ int main(int argc, char *argv[])
     sys.polarizability = 2;
     sys.sigma_squared = sys.sigma*sys.sigma;
     sys.sigma_sixth = sys.sigma_squared * sys.sigma_squared * sys.sigma_squared;
-    sys.sigma_twelfth = sys.sigma_sixth * sys.sigma_squared;
+    sys.sigma_twelfth = sys.sigma_sixth * sys.sigma_sixth;
 
-    srandom(time(NULL));//seed for random is current time
+    sys.half_box = sys.box_side_length * .5;
+    sys.cutoff = cutoff_in_sigma * sys.sigma;
+    if(cutoff_in_sigma <= 0 || sys.cutoff > sys.half_box)
+    {
+        sys.cutoff = sys.half_box;//minimum image can't see further than this
+    }
+    printf("                   CUTOFF            = %.2lf                \n",
+           sys.cutoff);
+    sys.energy_shift = 0;
+    if(sys.shift_flag)
+    {
+        double sr6 = sys.sigma_sixth / pow(sys.cutoff, 6);
+        sys.energy_shift = 4.0 * sys.epsilon * (sr6 * sr6 - sr6);
+    }
+    sys.volume = sys.box_side_length * sys.box_side_length * sys.box_side_length;
+    set_lj_params(&sys);
+    select_kernel(&sys, isa);
+    if(!check_kernel(&sys))
+    {
+        printf("The %s kernel disagrees with the scalar one, "
+               "using scalar instead.\n", sys.kernel_isa);
+        select_kernel(&sys, "scalar");
+    }
+    if(table_flag)
+    {
+        if(!build_table(&sys, table_file))
+        {
+            exit(EXIT_FAILURE);
+        }
+        sys.kernel = table_kernel;
+        sys.kernel_isa = "table";
+        if(table_file != NULL && sys.tail_flag)
+        {
+            printf("The tail correction is only for Lennard-Jones, "
+                   "so -tail is off with -tablefile.\n");
+            sys.tail_flag = false;
+        }
+    }
+    if(sys.checkerboard_flag && sys.speculative_moves > 1)
+    {
+        printf("Checkerboard sweeps already move every cell at once, "
+               "so -speculate is off with -checkerboard.\n");
+        sys.speculative_moves = 0;
+    }
+    if((replica_list != NULL) + (job_list != NULL) + (gibbs_particles > 0) > 1)
+    {
+        printf("Only one of -replicas, -batch and -gibbs can be used.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(sys.NPT_flag)
+    {
+        if(table_flag)
+        {
+            printf("NPT volume moves rescale Lennard-Jones sums, "
+                   "so -NPT can't use a table.\n");
+            exit(EXIT_FAILURE);
+        }
+        if(sys.NVT_flag || replica_list != NULL || gibbs_particles > 0)
+        {
+            printf("-NPT can't be used with -NVT, -replicas or -gibbs.\n");
+            exit(EXIT_FAILURE);
+        }
+        if(sys.checkerboard_flag || sys.speculative_moves > 1)
+        {
+            printf("Volume moves change the whole box at once, so "
+                   "-checkerboard and -speculate are off with -NPT.\n");
+            sys.checkerboard_flag = false;
+            sys.speculative_moves = 0;
+        }
+        if(!sys.tail_flag)
+        {
+            printf("Volume moves scale the cutoff with the box, so without "
+                   "-tail the truncated\npotential changes with the volume "
+                   "and so does the model sampled.\n");
+        }
+    }
+    if(tmmc_particles > 0)
+    {
+        if(sys.NVT_flag || sys.NPT_flag || replica_list != NULL ||
+           job_list != NULL || gibbs_particles > 0)
+        {
+            printf("-tmmc samples N in one grand canonical run, so it can't "
+                   "be used with -NVT, -NPT, -replicas, -batch or -gibbs.\n");
+            exit(EXIT_FAILURE);
+        }
+        if(start_particles > tmmc_particles)
+        {
+            printf("-particles can't start above the -tmmc limit.\n");
+            exit(EXIT_FAILURE);
+        }
+        if(sys.checkerboard_flag || sys.speculative_moves > 1)
+        {
+            printf("The collection matrix is filled one move at a time, so "
+                   "-checkerboard and -speculate are off with -tmmc.\n");
+            sys.checkerboard_flag = false;
+            sys.speculative_moves = 0;
+        }
+        tmmc_init(&sys, tmmc_particles);
+    }
+    if(sys.blocks.block_steps < 1)
+    {
+        sys.blocks.block_steps = 1;
+    }
+    if(sys.converge_flag && (replica_list != NULL || job_list != NULL ||
+                             gibbs_particles > 0 || tmmc_particles > 0))
+    {
+        printf("Replicas, jobs and Gibbs boxes all run to the end together, "
+               "and -tmmc has no production phase, so -converge is off.\n");
+        sys.converge_flag = false;
+    }
+    if(sys.tuning.tuning && (sys.checkerboard_flag ||
+                             sys.speculative_moves > 1))
+    {
+        printf("Checkerboard and speculative moves are drawn in batches, "
+               "so -tune is off with them.\n");
+        sys.tuning.tuning = false;
+    }
+    if(sys.histogram.bin_width > 0 &&
+       (sys.NPT_flag || tmmc_particles > 0 || gibbs_particles > 0))
+    {
+        printf("Reweighting needs unbiased runs at a fixed volume, so "
+               "-histogram is off with -NPT, -tmmc and -gibbs.\n");
+        sys.histogram.bin_width = 0;
+    }
+    if(gibbs_particles > 0)
+    {
+        if(sys.cutoff >= sys.half_box)
+        {
+            printf("Gibbs boxes change size, so -gibbs needs a -cutoff "
+                   "under half the box.\n");
+            exit(EXIT_FAILURE);
+        }
+        if(sys.checkerboard_flag || sys.speculative_moves > 1)
+        {
+            printf("The threads run whole boxes, so -checkerboard and "
+                   "-speculate are off with -gibbs.\n");
+            sys.checkerboard_flag = false;
+            sys.speculative_moves = 0;
+        }
+        if(start_particles > 0)
+        {
+            printf("-gibbs fills both boxes itself, so -particles is off "
+                   "with -gibbs.\n");
+            start_particles = 0;
+        }
+    }
+    if(job_list != NULL)
+    {
+        if(!read_jobs(job_list, &jobs))
+        {
+            exit(EXIT_FAILURE);
+        }
+        if(sys.speculative_moves > 1)
+        {
+            printf("The threads run whole jobs, "
+                   "so -speculate is off with -batch.\n");
+            sys.speculative_moves = 0;
+        }
+    }
+    if(replica_list != NULL)
+    {
+        if(!read_replicas(replica_list, &replica_temps, &replica_pressures))
+        {
+            exit(EXIT_FAILURE);
+        }
+        if(sys.speculative_moves > 1)
+        {
+            printf("The threads run whole replicas, "
+                   "so -speculate is off with -replicas.\n");
+            sys.speculative_moves = 0;
+        }
+    }
+    if(sys.checkerboard_flag && sys.tail_flag)
+    {
+        printf("The tail correction depends on the whole box's N, "
+               "so -tail is off with -checkerboard.\n");
+        sys.tail_flag = false;
+    }
+    if(sys.shift_flag && sys.tail_flag)
+    {
+        printf("The tail correction assumes LJ is cut off but not "
+               "shifted, so -shift and -tail can't be used together.\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("                   ENERGY KERNEL     = %s                   \n"
+           "                   PRECISION         = %s                   \n"
+           "                   THREADS           = %d                   \n",
+           sys.kernel_isa, PRECISION_NAME, threads);
+    if(replica_list != NULL)
+    {
+        printf("                   REPLICAS          = %d                   \n",
+               (int)replica_temps.size());
+    }
+    if(job_list != NULL)
+    {
+        printf("                   JOBS              = %d                   \n",
+               (int)jobs.size());
+    }
+    if(gibbs_particles > 0)
+    {
+        printf("                   GIBBS PARTICLES   = %d                   \n",
+               gibbs_particles);
+    }
+    bool single_run = replica_list == NULL && job_list == NULL &&
+                      gibbs_particles == 0;
+
+    if(!seed_given)
+    {
+        sys.seed = random_seed();
+    }
+    rng_seed(&sys.rng, sys.seed, 0);
+    if(sys.restart_file == NULL)//a restart carries on with its checkpoint's seed
+    {
+        printf("                   SEED              = %" PRIu64 "\n",
+               sys.seed);
+    }
 
-    if(sys.energy_output_flag)
+    //replicas, jobs and Gibbs boxes open their own files
+    if(sys.energy_output_flag && single_run)
     {
         sys.energies = fopen("energies.dat", "w");
     }
-    if(sys.output_flag)
+    if(sys.output_flag && single_run)
     {
         sys.output = fopen("output.txt", "w");
     }
-
-    sys.unweightedradial = fopen("unweightedradialdistribution.txt", "w");
-    sys.weightedradial = fopen("weightedradialdistribution.txt", "w");
+    if(single_run)
+    {
+        sys.unweightedradial = fopen("unweightedradialdistribution.txt", "w");
+        sys.weightedradial = fopen("weightedradialdistribution.txt", "w");
+    }
 
 
     sys.start_time = clock();
@@ -126,11 +597,14 @@ int main(int argc, char *argv[])
     printf("|                      STARTING  GCMC                      |\n");
     printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
     sys.step = 0;
-    sys.cutoff = sys.box_side_length * .5;
+    store_init(&sys.particles, sys.box_side_length);
+    arena_init(&sys.scratch);
+    start_threads(&sys, threads);
 
     if(sys.debug_flag)
     {
         particle added;
+        added.id = -1;
 
         added.x[0] = 0;
         added.x[1] = 0;
@@ -138,91 +612,132 @@ int main(int argc, char *argv[])
         added.dipole[0] = 1/85.10597636;
         added.dipole[1] = 0/85.10597636;
         added.dipole[2] = 0/85.10597636;
-        sys.particles.push_back(added);
+        store_insert(&sys.particles, &added);
 
         particle added2;
+        added2.id = -1;
         added2.x[0] = 4;
         added2.x[1] = 0;
         added2.x[2] = 0;
         added2.dipole[0] = 1/85.10597636;
         added2.dipole[1] = 0/85.10597636;
         added2.dipole[2] = 0/85.10597636;
-        sys.particles.push_back(added2);
+        store_insert(&sys.particles, &added2);
     }
 
-    currentPE = calculate_PE(&sys);//energy at first step 
-
-    if(sys.energy_output_flag)
+    if(sys.restart_file != NULL && single_run)//copies read their own
+    {
+        if(!read_checkpoint(&sys, sys.restart_file, false))
+        {
+            exit(EXIT_FAILURE);
+        }
+        if(tmmc_particles > 0 && sys.particles.count > tmmc_particles)
+        {
+            printf("The checkpoint has more particles than the -tmmc "
+                   "limit.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if(start_particles > 0)
     {
-        fprintf(sys.energies, "0 %lf\n", currentPE);
+        place_lattice(&sys, start_particles);
     }
-
-
-    n = sys.particles.size(); //particle count 
-    sys.sumenergy = currentPE;
-    sys.sumparticles = n;
-    sys.volume = sys.box_side_length * sys.box_side_length * sys.box_side_length;
-
-    for(sys.step = 1; sys.step<sys.maxStep; sys.step++)
-    {
-            move_type = make_move(&sys); 
-            
-            newPE = calculate_PE(&sys);
-            if(sys.step % (sys.maxStep/10) == 0)
-            {
-                double cycles_till_now = (double)(clock()-sys.start_time),
-                       time_till_now = cycles_till_now/CLOCKS_PER_SEC;
-                printf("  %.0f%% of iteration steps done. Time elapsed:"\
-                        " %.2lf seconds.\n",\
-                        ((double)sys.step/(double)sys.maxStep)*100, time_till_now);
-            }
-            if(move_accepted(currentPE, newPE,\
-                        move_type, &sys))
-            {
-                    currentPE = newPE;//updates energy
-                    sys.sumenergy += newPE;
-                    output(&sys,newPE);
-                    if(sys.step>=sys.maxStep*.5)
-                    {
-                        n = sys.particles.size();
-                        sys.sumparticles += n;
-                        radialDistribution(&sys,sys.step);
-                    }
-            }
-            else // Move rejected
-            {
-                    undo_move(&sys, move_type);
-                    sys.sumenergy += currentPE;
-                    output(&sys,currentPE);
-                    if(sys.step>=sys.maxStep*.5)
-                    {
-                        n = sys.particles.size();
-                        sys.sumparticles += n;
-                        radialDistribution(&sys,sys.step);
-                    }
-            }
+    build_cells(&sys);
+    if(sys.checkerboard_flag && sys.cells.cells_per_side == 0)
+    {
+        printf("-checkerboard needs at least four cells a cutoff wide "
+               "along each side of the box.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(replica_list != NULL)
+    {
+        run_replicas(&sys, replica_temps, replica_pressures, swap_interval);
+    }
+    else if(job_list != NULL)
+    {
+        run_batch(&sys, &jobs);
     }
+    else if(gibbs_particles > 0)
+    {
+        run_gibbs(&sys, gibbs_particles, swap_interval);
+    }
+    else
+    {
+        run_simulation(&sys, sys.maxStep);
+    }
+
     double cycles_till_now = (double)(clock()-sys.start_time),
            time_till_now = cycles_till_now/CLOCKS_PER_SEC;
     printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
     printf("|                      GCMC  COMPLETE                      |\n");
     printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+    //a -converge run that never settled has nothing to average over
+    bool produced = sys.production_steps > 0;
+    if(tmmc_particles > 0)
+    {
+        //the bias skews the plain averages, so only ln Pi is reported
+        write_ln_pi(&sys, "lnpi.txt");
+    }
+    else if(single_run)
+    {
+        if(produced)
+        {
+            printf("Average number of particles: %lf\n"
+                   "Average energy: %lf K\n",
+                   sys.sumparticles/sys.production_steps,
+                   sys.sumenergy/sys.production_steps);
+        }
+        if(sys.NPT_flag && produced)
+        {
+            double average_volume = sys.sumvolume/sys.production_steps;
+            printf("Average volume: %lf A^3\n"
+                   "Average density: %lf per A^3\n", average_volume,
+                   sys.sumparticles/sys.production_steps/average_volume);
+        }
+        FILE * blocks = fopen("blocks.txt", "w");
+        write_block_summary(&sys, blocks);
+        if(blocks != NULL)
+        {
+            fclose(blocks);
+        }
+    }
+    if(sys.histogram.bin_width > 0 && single_run && produced)
+    {
+        FILE * histogram = fopen("histogram.txt", "w");
+        if(histogram != NULL)
+        {
+            write_histogram(&sys, histogram);
+            fclose(histogram);
+        }
+    }
+    if(sys.tail_flag && single_run && tmmc_particles == 0 && produced)
+    {
+        double density = (sys.sumparticles/sys.production_steps)/sys.volume;
+        printf("Tail correction to the pressure: %lf atm\n",
+               tail_pressure(&sys, density) / conv_factor);
+    }
     printf("This run took %f seconds.\nHave a nice day!\n"\
             ,time_till_now);//always good to have manners
 
     free(sys.boxes);
+    store_free(&sys.particles);
+    arena_free(&sys.scratch);
+    stop_threads(&sys);
 
     
-    if(sys.energy_output_flag)
-    {
-        fclose(sys.energies);
-    }
-    if(sys.output_flag)
+    if(single_run)
     {
-        fclose(sys.output);
+        if(sys.energy_output_flag)
+        {
+            fclose(sys.energies);
+        }
+        if(sys.output_flag)
+        {
+            fclose(sys.output);
+        }
+        fclose(sys.unweightedradial);
+        fclose(sys.weightedradial);
     }
-    fclose(sys.unweightedradial);
-    fclose(sys.weightedradial);
 
     return 0;
 }
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <map>
+#include <vector>
+
+/*******************************************************************************
+This combines the (N, E) histograms written by grand -histogram into one
+estimate of the density of states, by the multiple histogram (WHAM) method, and
+uses it to predict <N> and <E> at temperatures and pressures that were never
+run. All the runs have to be of the same species in the same box, with the same
+bin width; runs at neighbouring state points whose histograms overlap are what
+make the estimate good in between.
+
+usage: reweight -at T P [-at T P ...] histogram files...
+with T in kelvin and P in atm, the reservoir pressure grand uses for mu.
+
+In run i, at beta_i and activity a_i = ln(beta_i P_i V), a state (N, E) turns
+up with probability omega(N, E) exp(-beta_i E + a_i N - f_i), where omega is
+the density of states (with the V^N / N! in it) and f_i is ln of run i's grand
+partition function. With H(N, E) the counts summed over the runs and n_i the
+counts in run i, the best omega and f_i solve
+    omega(N, E) = H(N, E) / sum_i n_i exp(-beta_i E + a_i N - f_i)
+    f_i = ln sum_(N, E) omega(N, E) exp(-beta_i E + a_i N)
+which is iterated from f_i = 0 until the f_i stop changing.
+********************************************************************************/
+
+#define CONV_FACTOR 0.0073389366 //converts ATM to K/A^3, as in grand
+#define MAX_ITERATIONS 100000
+#define TOLERANCE 1e-10
+
+typedef struct _run
+{
+    double temperature,
+           pressure,
+           volume,
+           bin_width,
+           total;//samples in the histogram
+} run;
+
+typedef struct _state
+{
+    int n;
+    double energy;
+    std::vector<double> counts;//in each run
+    double total,
+           ln_omega;
+} state;
+
+//ln(exp(a) + exp(b)) without overflowing
+static double log_add(double a, double b)
+{
+    if(a < b)
+    {
+        double t = a;
+        a = b;
+        b = t;
+    }
+    if(b == -HUGE_VAL)
+    {
+        return a;
+    }
+    return a + log1p(exp(b - a));
+}
+
+static double activity(double temperature, double pressure, double volume)
+{
+    return log(pressure * CONV_FACTOR * volume / temperature);
+}
+
+//reads one histogram file into run r of runs and states
+static bool read_histogram(const char *file, int r, int run_count,
+                           std::vector<run> *runs,
+                           std::map<std::pair<int, long>, state> *states)
+{
+    FILE * in = fopen(file, "r");
+    if(in == NULL)
+    {
+        printf("Can't open %s.\n", file);
+        return false;
+    }
+    run * this_run = &(*runs)[r];
+    char line[256];
+    while(fgets(line, sizeof line, in) != NULL)
+    {
+        double value;
+        int n;
+        if(sscanf(line, "# T %lf", &value) == 1)
+        {
+            this_run->temperature = value;
+        }
+        else if(sscanf(line, "# P %lf", &value) == 1)
+        {
+            this_run->pressure = value;
+        }
+        else if(sscanf(line, "# V %lf", &value) == 1)
+        {
+            this_run->volume = value;
+        }
+        else if(sscanf(line, "# bin %lf", &value) == 1)
+        {
+            this_run->bin_width = value;
+        }
+        else if(line[0] != '#')
+        {
+            double energy, count;
+            if(sscanf(line, "%d %lf %lf", &n, &energy, &count) != 3)
+            {
+                continue;
+            }
+            if(this_run->bin_width <= 0)
+            {
+                printf("%s has no bin width before its counts.\n", file);
+                fclose(in);
+                return false;
+            }
+            std::pair<int, long> key(n, lround(energy / this_run->bin_width -
+                                               0.5));
+            state * s = &(*states)[key];
+            if(s->counts.empty())
+            {
+                s->n = n;
+                s->energy = energy;
+                s->counts.assign(run_count, 0);
+            }
+            s->counts[r] += count;
+            this_run->total += count;
+        }
+    }
+    fclose(in);
+    if(this_run->temperature <= 0 || this_run->pressure <= 0 ||
+       this_run->volume <= 0 || this_run->total <= 0)
+    {
+        printf("%s isn't a histogram from grand -histogram.\n", file);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<double> target_temps, target_pressures;
+    std::vector<const char*> files;
+    for(int i = 1;i < argc;i++)
+    {
+        if(strcmp(argv[i], "-at") == 0 && i+2 < argc)
+        {
+            target_temps.push_back(atof(argv[i+1]));
+            target_pressures.push_back(atof(argv[i+2]));
+            i += 2;
+        }
+        else
+        {
+            files.push_back(argv[i]);
+        }
+    }
+    if(files.empty() || target_temps.empty())
+    {
+        printf("usage: reweight -at T P [-at T P ...] histogram files...\n"
+               "\tT in kelvin and P in atm; the histograms come from\n"
+               "\tgrand -histogram w, all in the same box with the same w\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int run_count = files.size();
+    std::vector<run> runs(run_count, run());
+    std::map<std::pair<int, long>, state> states;
+    for(int r = 0;r < run_count;r++)
+    {
+        if(!read_histogram(files[r], r, run_count, &runs, &states))
+        {
+            exit(EXIT_FAILURE);
+        }
+        if(fabs(runs[r].volume - runs[0].volume) > 1e-6 * runs[0].volume ||
+           runs[r].bin_width != runs[0].bin_width)
+        {
+            printf("%s has a different volume or bin width from %s.\n",
+                   files[r], files[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    double volume = runs[0].volume;
+
+    std::vector<double> beta(run_count), a(run_count), ln_total(run_count),
+                        f(run_count, 0), next_f(run_count);
+    for(int r = 0;r < run_count;r++)
+    {
+        beta[r] = 1.0 / runs[r].temperature;
+        a[r] = activity(runs[r].temperature, runs[r].pressure, volume);
+        ln_total[r] = log(runs[r].total);
+    }
+    for(auto & entry : states)
+    {
+        state * s = &entry.second;
+        s->total = 0;
+        for(int r = 0;r < run_count;r++)
+        {
+            s->total += s->counts[r];
+        }
+    }
+
+    //iterate the WHAM equations, holding f of the first run at 0
+    int iteration = 0;
+    double change = HUGE_VAL;
+    for(;iteration < MAX_ITERATIONS && change > TOLERANCE;iteration++)
+    {
+        for(int r = 0;r < run_count;r++)
+        {
+            next_f[r] = -HUGE_VAL;
+        }
+        for(auto & entry : states)
+        {
+            state * s = &entry.second;
+            double denominator = -HUGE_VAL;
+            for(int r = 0;r < run_count;r++)
+            {
+                denominator = log_add(denominator, ln_total[r] -
+                                      beta[r] * s->energy + a[r] * s->n - f[r]);
+            }
+            s->ln_omega = log(s->total) - denominator;
+            for(int r = 0;r < run_count;r++)
+            {
+                next_f[r] = log_add(next_f[r], s->ln_omega -
+                                    beta[r] * s->energy + a[r] * s->n);
+            }
+        }
+        change = 0;
+        for(int r = 0;r < run_count;r++)
+        {
+            double moved = next_f[r] - next_f[0];
+            change = fmax(change, fabs(moved - f[r]));
+            f[r] = moved;
+        }
+    }
+    printf("Combined %d histograms, %d (N, E) bins, in %d iterations.\n",
+           run_count, (int)states.size(), iteration);
+    if(change > TOLERANCE)
+    {
+        printf("The free energies didn't settle (last change %g); "
+               "do the histograms overlap?\n", change);
+    }
+
+    /***************************************************************************
+    Every target's probabilities come from omega. n_eff is how many samples
+    the estimate is worth there, 1 / sum p^2 / H: when it is much smaller than
+    the runs' samples, the target is too far from any run to be trusted.
+    ***************************************************************************/
+    printf("T(K)\tP(atm)\t<N>\t<E>(K)\tn_eff\n");
+    for(size_t t = 0;t < target_temps.size();t++)
+    {
+        double target_beta = 1.0 / target_temps[t],
+               target_a = activity(target_temps[t], target_pressures[t], volume),
+               ln_z = -HUGE_VAL;
+        for(auto & entry : states)
+        {
+            state * s = &entry.second;
+            ln_z = log_add(ln_z, s->ln_omega - target_beta * s->energy +
+                                 target_a * s->n);
+        }
+        double average_n = 0,
+               average_e = 0,
+               spread = 0;
+        for(auto & entry : states)
+        {
+            state * s = &entry.second;
+            double p = exp(s->ln_omega - target_beta * s->energy +
+                           target_a * s->n - ln_z);
+            average_n += p * s->n;
+            average_e += p * s->energy;
+            spread += p * p / s->total;
+        }
+        printf("%lf\t%g\t%lf\t%lf\t%.0lf\n", target_temps[t],
+               target_pressures[t], average_n, average_e, 1.0 / spread);
+    }
+    return 0;
+}